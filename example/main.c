@@ -107,11 +107,11 @@ int bufferRead(void) {
   *ptr++ = (uint8)(CHUNK_SIZE & 0xFF);
 
   // Submit the write
-  uStatus = usbBulkWriteAsyncSubmit(deviceHandle, 2, (uint32)(ptr-buf), 1000, &error);
+  uStatus = usbBulkWriteAsyncSubmit(deviceHandle, 2, (uint32)(ptr-buf), 1000, 0, &error);
   CHECK_STATUS(uStatus, 5, cleanup);
 
   // Submit the read
-  uStatus = usbBulkReadAsync(deviceHandle, 6, NULL, CHUNK_SIZE, 9000, &error);  // Read response data
+  uStatus = usbBulkReadAsync(deviceHandle, 6, NULL, CHUNK_SIZE, 9000, 0, &error);  // Read response data
   CHECK_STATUS(uStatus, 6, cleanup);
 
   // Wait for them to be serviced
@@ -176,14 +176,14 @@ int multiRead(uint32 reqCount, uint32 reqSize, double *speed) {
   #endif
 
   // Send a couple of read commands to the FPGA
-  uStatus = usbBulkWriteAsync(deviceHandle, 2, buf, 5, 9000, &error);  // Write request command
+  uStatus = usbBulkWriteAsync(deviceHandle, 2, buf, 5, 9000, 0, &error);  // Write request command
   CHECK_STATUS(uStatus, 4, cleanup);
-  uStatus = usbBulkReadAsync(deviceHandle, 6, NULL, reqSize, 9000, &error);  // Read response data
+  uStatus = usbBulkReadAsync(deviceHandle, 6, NULL, reqSize, 9000, 0, &error);  // Read response data
   CHECK_STATUS(uStatus, 5, cleanup);
 
-  uStatus = usbBulkWriteAsync(deviceHandle, 2, buf, 5, 9000, &error);  // Write request command
+  uStatus = usbBulkWriteAsync(deviceHandle, 2, buf, 5, 9000, 0, &error);  // Write request command
   CHECK_STATUS(uStatus, 6, cleanup);
-  uStatus = usbBulkReadAsync(deviceHandle, 6, NULL, reqSize, 9000, &error);  // Read response data
+  uStatus = usbBulkReadAsync(deviceHandle, 6, NULL, reqSize, 9000, 0, &error);  // Read response data
   CHECK_STATUS(uStatus, 7, cleanup);
 
   // On each iteration, await completion and send a new read command
@@ -196,9 +196,9 @@ int multiRead(uint32 reqCount, uint32 reqSize, double *speed) {
     CHECK_STATUS(uStatus, 9, cleanup);
     printCompletionReport(&completionReport);
 
-    uStatus = usbBulkWriteAsync(deviceHandle, 2, buf, 5, 9000, &error);  // Write request command
+    uStatus = usbBulkWriteAsync(deviceHandle, 2, buf, 5, 9000, 0, &error);  // Write request command
     CHECK_STATUS(uStatus, 10, cleanup);
-    uStatus = usbBulkReadAsync(deviceHandle, 6, NULL, reqSize, 9000, &error);  // Read response data
+    uStatus = usbBulkReadAsync(deviceHandle, 6, NULL, reqSize, 9000, 0, &error);  // Read response data
     CHECK_STATUS(uStatus, 11, cleanup);
   }
 
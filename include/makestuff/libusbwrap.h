@@ -59,25 +59,141 @@ extern "C" {
     USB_ASYNC_SUBMIT,              ///< Async submission error.
     USB_ASYNC_EVENT,               ///< Async event error.
     USB_ASYNC_TRANSFER,            ///< Async transfer error.
-    USB_ASYNC_SIZE,                ///< Async API transfers must be 64KiB or smaller.
-    USB_TIMEOUT                    ///< An operation timed out.
+    USB_ASYNC_SIZE,                ///< Async transfer is too big for the library's buffers.
+    USB_TIMEOUT,                   ///< An operation timed out.
+    USB_THREAD,                    ///< The event-handling thread could not be started.
+    USB_PENDING,                   ///< Nothing completed before an await timed out.
+    USB_INVALID_OPTIONS,           ///< The supplied open options are inconsistent.
+    USB_QUEUE_FULL,                ///< The endpoint already has its maximum number of transfers.
+    USB_INTERRUPT,                 ///< A USB interrupt read or write failed.
+    USB_STREAMS,                   ///< Bulk streams could not be allocated or freed.
+    USB_POLLED                     ///< The endpoint is being polled by \c usbInterruptPollStart().
   } USBStatus;
   //@}
 
+  /**
+   * Pass this as the timeout of the await functions to wait indefinitely.
+   */
+  #define USB_WAIT_FOREVER 0xFFFFFFFFU
+
   // Forward-declaration of the LibUSB handle
   struct USBDevice;
 
+  // Forward-declaration of a LibUSB context, created by usbContextCreate()
+  struct USBContext;
+
+  // Forward-declaration of a streaming read, started by usbStreamReadStart()
+  struct USBReadStream;
+
+  // Forward-declaration of a streaming write, started by usbStreamWriteStart()
+  struct USBWriteStream;
+
   struct AsyncTransferFlags {
     uint32 isRead : 1;
+    uint32 isPoll : 1;  ///< Read armed by \c usbInterruptPollStart().
+    uint32 pollStopped : 1;  ///< Polling stopped after this read, which failed or couldn't re-arm.
+  };
+
+  /**
+   * How the transfers reaped by \c usbCancelAll() ended.
+   */
+  struct DrainReport {
+    size_t numCompleted;  ///< Finished successfully before they could be cancelled.
+    size_t numCancelled;  ///< Cancelled in flight.
+    size_t numFailed;     ///< Failed in some other way, e.g. timed out.
+  };
+
+  /**
+   * The stall history of an endpoint, as returned by \c usbGetStallStats().
+   */
+  struct StallStats {
+    uint32 numStalls;      ///< Transfers that have stalled since the device was opened.
+    uint32 numRecoveries;  ///< Times the halt was cleared and the pipeline resubmitted.
+  };
+
+  /**
+   * The outcome of one packet of an isochronous transfer.
+   */
+  struct IsoPacketReport {
+    uint32 offset;        ///< Where the packet's data starts in the transfer's buffer.
+    uint32 actualLength;  ///< Number of bytes actually transferred.
+    USBStatus status;     ///< \c USB_SUCCESS, or why this packet failed.
   };
 
   struct CompletionReport {
-    const uint8 *buffer;
+    const uint8 *buffer;  ///< The data; a library buffer is valid until the endpoint's next submit.
     uint32 requestLength;
     uint32 actualLength;
     struct AsyncTransferFlags flags;
+    uint32 id;        ///< The nth async transfer submitted on a device has id n-1.
+    uint64 tag;       ///< The caller's tag, as given when the transfer was submitted.
+    int transferStatus;  ///< The raw LibUSB status (an <code>enum libusb_transfer_status</code>).
+    uint8 endpoint;   ///< Endpoint address, including the direction bit.
+    const struct IsoPacketReport *packets;  ///< Per-packet results if isochronous, else \c NULL.
+    uint32 numPackets;                      ///< Number of entries in \c packets.
+    uint32 streamId;                        ///< Bulk stream the transfer used, or zero.
+  };
+
+  /**
+   * One transfer in a batch submitted by \c usbBulkSubmitBatch().
+   */
+  struct BulkTransferRequest {
+    uint8 endpoint;   ///< Endpoint address; the direction bit selects read or write.
+    uint8 *buffer;    ///< Data to write, or space to read into (\c NULL reads into the library's).
+    uint32 length;    ///< Number of bytes to transfer; at most the buffer size for library buffers.
+    uint32 timeout;   ///< Timeout in milliseconds.
+    uint64 tag;       ///< Echoed in the transfer's completion report.
+  };
+
+  /**
+   * One piece of a write gathered by \c usbBulkWritev() or \c usbBulkWritevAsync().
+   */
+  struct BulkSegment {
+    const uint8 *data;  ///< The bytes to write.
+    uint32 length;      ///< Number of bytes.
+  };
+
+  /**
+   * Per-device tuning for the async API, given to \c usbOpenDeviceWithOptions().
+   */
+  struct USBOpenOptions {
+    size_t initialDepth;  ///< Transfers created up-front for each endpoint used; at least one.
+    size_t maxDepth;      ///< Most transfers in flight on one endpoint; zero for no limit.
+    uint32 bufferSize;    ///< Size of each transfer's library buffer; zero for caller buffers only.
+  };
+
+  /**
+   * The options used by \c usbOpenDevice(): four transfers deep, unlimited, with 64KiB buffers.
+   */
+  #define USB_DEFAULT_OPEN_OPTIONS {4, 0, 0x10000}
+
+  /**
+   * Passed to \c usbCancelAll() to select every endpoint.
+   */
+  #define USB_ALL_ENDPOINTS 0xFF
+
+  /**
+   * A file descriptor LibUSB needs watched, as returned by \c usbGetPollFds().
+   */
+  struct USBPollFd {
+    int fd;        ///< The file descriptor.
+    short events;  ///< The \c poll() events to watch it for.
   };
 
+  /**
+   * Signatures of the callbacks registered with \c usbSetPollFdNotifiers().
+   */
+  typedef void (*USBPollFdAddedCallback)(int fd, short events, void *userData);
+  typedef void (*USBPollFdRemovedCallback)(int fd, void *userData);
+
+  /**
+   * Signature of a completion callback registered with \c usbSetCompletionCallback().
+   */
+  typedef void (*USBCompletionCallback)(
+    struct USBDevice *dev, const struct CompletionReport *report, USBStatus status,
+    void *userData
+  );
+
   // ---------------------------------------------------------------------------------------------
   // Functions
   // ---------------------------------------------------------------------------------------------
@@ -111,6 +227,40 @@ extern "C" {
    */
   DLLEXPORT(void) usbShutdown();
 
+  /**
+   * @brief Create a LibUSB context of its own, in addition to the default one set up by
+   * \c usbInitialise().
+   *
+   * Each context has its own event handling: awaiting a transfer on a device in one context
+   * never handles events for devices in another, and each context can have its own event thread.
+   * So a process driving many devices can shard them across contexts, and hence across cores.
+   *
+   * @param debugLevel 0->none, 1, 2, 3->lots.
+   * @param ctx A pointer to a <code>struct USBContext*</code> to be set on exit to point to the
+   *            new context.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if the context was created.
+   *     - \c USB_ALLOC_ERR if an allocation failed.
+   *     - \c USB_INIT if there were problems initialising LibUSB.
+   */
+  DLLEXPORT(USBStatus) usbContextCreate(
+    int debugLevel, struct USBContext **ctx, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Stop a context's event thread, if it's running, and destroy the context.
+   *
+   * Every device opened in the context must be closed first.
+   *
+   * @param ctx The context from \c usbContextCreate().
+   */
+  DLLEXPORT(void) usbContextDestroy(struct USBContext *ctx);
+
   /**
    * @brief Determine whether or not the specified device is attached.
    *
@@ -165,9 +315,80 @@ extern "C" {
     struct USBDevice **devHandlePtr, const char **error
   ) WARN_UNUSED_RESULT;
 
+  /**
+   * @brief Open a device, as \c usbOpenDevice(), with control over its async transfer pool.
+   *
+   * Each endpoint's pool of transfers is created on first use with \c initialDepth transfers,
+   * and grows on demand up to \c maxDepth transfers in flight. Library buffers, used by
+   * \c usbBulkWriteAsyncPrepare() and by reads with a \c NULL buffer, are allocated as needed
+   * and pooled. Where LibUSB supports it (e.g. usbfs on Linux) they are device memory that the
+   * kernel transfers into directly, so no copy is made; otherwise they come from the heap.
+   *
+   * @param vp The Vendor ID and Product ID to look for (e.g "04B4:8613").
+   * @param configuration The USB configuration to enable on the device.
+   * @param iface The USB interface to enable on the device.
+   * @param alternateInterface The USB alternate interface to choose.
+   * @param options The pool settings, or \c NULL for \c USB_DEFAULT_OPEN_OPTIONS.
+   * @param devHandlePtr A pointer to a <code>struct USBDevice*</code> to be set on exit to
+   *            point to the newly-allocated LibUSB structure.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - The same codes as \c usbOpenDevice().
+   *     - \c USB_INVALID_OPTIONS if \c initialDepth is zero or exceeds a nonzero \c maxDepth.
+   */
+  DLLEXPORT(USBStatus) usbOpenDeviceWithOptions(
+    const char *vp, int configuration, int iface, int alternateInterface,
+    const struct USBOpenOptions *options, struct USBDevice **devHandlePtr, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Open a device, as \c usbOpenDeviceWithOptions(), in the given context.
+   *
+   * The device's async transfers are driven by that context's event handling: by its event
+   * thread if it has one, otherwise by threads awaiting them.
+   *
+   * @param ctx The context from \c usbContextCreate(), or \c NULL for the default context.
+   * @param vp The Vendor ID and Product ID to look for (e.g "04B4:8613").
+   * @param configuration The USB configuration to enable on the device.
+   * @param iface The USB interface to enable on the device.
+   * @param alternateInterface The USB alternate interface to choose.
+   * @param options The pool settings, or \c NULL for \c USB_DEFAULT_OPEN_OPTIONS.
+   * @param devHandlePtr A pointer to a <code>struct USBDevice*</code> to be set on exit to
+   *            point to the newly-allocated LibUSB structure.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - The same codes as \c usbOpenDeviceWithOptions().
+   */
+  DLLEXPORT(USBStatus) usbOpenDeviceInContext(
+    struct USBContext *ctx, const char *vp, int configuration, int iface,
+    int alternateInterface, const struct USBOpenOptions *options,
+    struct USBDevice **devHandlePtr, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Get the context a device was opened in.
+   *
+   * @param dev The target device.
+   * @returns The device's context, which is the default context if it was opened without one.
+   */
+  DLLEXPORT(struct USBContext *) usbDeviceContext(struct USBDevice *dev);
+
   /**
    * @brief Close a previously-opened device.
    *
+   * Any transfers still outstanding are cancelled and reaped first, as by \c usbCancelAll(). If
+   * LibUSB event-handling fails before they have all come back, the device is leaked rather than
+   * freed while LibUSB still owns some of them. Read and write streams are not stopped; stop
+   * them with \c usbStreamReadStop() and \c usbStreamWriteStop() before closing the device.
+   *
    * @param dev The target device.
    * @param iface The interface previously claimed.
    */
@@ -294,34 +515,1112 @@ extern "C" {
     uint32 timeout, const char **error
   ) WARN_UNUSED_RESULT;
 
-  // Caller supplies the buffer
+  /**
+   * @brief Read data from an interrupt endpoint.
+   *
+   * Unlike \c usbBulkRead(), a short read is not an error, since interrupt messages are often
+   * shorter than the largest the device might send.
+   *
+   * @param dev The target device.
+   * @param endpoint The endpoint to read from.
+   * @param data Suitably-sized buffer for the IN data to be received from the device.
+   * @param numBytes The most bytes to read. Buffer should be at least this size.
+   * @param numRead A pointer to a \c uint32 to be set on exit to the number of bytes read.
+   * @param timeout The timeout in milliseconds.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns An error code.
+   */
+  DLLEXPORT(USBStatus) usbInterruptRead(
+    struct USBDevice *dev, uint8 endpoint, uint8 *data, uint32 numBytes, uint32 *numRead,
+    uint32 timeout, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Write data to an interrupt endpoint.
+   *
+   * @param dev The target device.
+   * @param endpoint The endpoint to write to.
+   * @param data The data to send to the device.
+   * @param numBytes The number of bytes to write. Buffer should be at least this size.
+   * @param timeout The timeout in milliseconds.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns An error code.
+   */
+  DLLEXPORT(USBStatus) usbInterruptWrite(
+    struct USBDevice *dev, uint8 endpoint, const uint8 *data, uint32 numBytes,
+    uint32 timeout, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  // Caller supplies the buffer, of any length. Transfers larger than 64KiB are split into
+  // several LibUSB transfers, which are pipelined and reported as one completion; a short
+  // read ends the whole transfer early. Like every async submission, it takes a tag of the
+  // caller's choosing, which is echoed in the transfer's CompletionReport.
   DLLEXPORT(USBStatus) usbBulkWriteAsync(
     struct USBDevice *dev, uint8 endpoint, const uint8 *buffer, uint32 length, uint32 timeout,
-    const char **error
+    uint64 tag, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Write the concatenation of several segments as one async bulk write.
+   *
+   * The device sees the same packets as if the segments had been copied into one buffer. Large
+   * segments are sent in place, starting on a packet boundary; small ones, and the few bytes it
+   * takes to pad up to a boundary, are copied into the transfer's library buffer, so their
+   * total must fit in the buffer size chosen at open time. Segments sent in place must remain
+   * valid until the write completes; the segment array itself may be reused on return. The
+   * completion is reported like any other, with the total length.
+   *
+   * @param dev The target device.
+   * @param endpoint The endpoint to write to.
+   * @param segments The pieces to write, in order.
+   * @param count The number of segments.
+   * @param timeout The timeout in milliseconds.
+   * @param tag A value of the caller's choosing, echoed in the completion report.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if the write was submitted.
+   *     - \c USB_CANNOT_GET_DESCRIPTOR if the endpoint's max packet size is unavailable.
+   *     - \c USB_ASYNC_SIZE if the copied segments don't fit in a library buffer.
+   *     - \c USB_ALLOC_ERR if an allocation failed.
+   *     - \c USB_ASYNC_SUBMIT if LibUSB rejected the write.
+   */
+  DLLEXPORT(USBStatus) usbBulkWritevAsync(
+    struct USBDevice *dev, uint8 endpoint, const struct BulkSegment *segments, size_t count,
+    uint32 timeout, uint64 tag, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Write the concatenation of several segments synchronously.
+   *
+   * The segments are split up exactly as by \c usbBulkWritevAsync(), and the resulting pieces
+   * are written one after another, each with the given timeout.
+   *
+   * @param dev The target device.
+   * @param endpoint The endpoint to write to.
+   * @param segments The pieces to write, in order.
+   * @param count The number of segments.
+   * @param timeout The timeout of each piece in milliseconds.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if all the data was written.
+   *     - \c USB_CANNOT_GET_DESCRIPTOR if the endpoint's max packet size is unavailable.
+   *     - \c USB_ASYNC_SIZE if the copied segments don't fit in a library buffer.
+   *     - \c USB_ALLOC_ERR if an allocation failed.
+   *     - \c USB_TIMEOUT if a piece timed out.
+   *     - \c USB_BULK if a piece could not be written.
+   */
+  DLLEXPORT(USBStatus) usbBulkWritev(
+    struct USBDevice *dev, uint8 endpoint, const struct BulkSegment *segments, size_t count,
+    uint32 timeout, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Lease a library buffer from the device's pool.
+   *
+   * The buffer is the size chosen at open time, and where possible it's device memory, so reads
+   * into it and writes from it avoid a copy in the kernel. It can be passed to any async or sync
+   * call as a caller buffer, and handed on down a processing pipeline, until it's given back with
+   * \c usbBufferRelease(). Any still leased when the device is closed are freed.
+   *
+   * @param dev The target device.
+   * @param buffer A pointer to be set on exit to the leased buffer.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if a buffer was leased.
+   *     - \c USB_ASYNC_SIZE if the device was opened without library buffers.
+   *     - \c USB_ALLOC_ERR if an allocation failed.
+   */
+  DLLEXPORT(USBStatus) usbBufferLease(
+    struct USBDevice *dev, uint8 **buffer, const char **error
   ) WARN_UNUSED_RESULT;
 
+  /**
+   * @brief Give a buffer leased by \c usbBufferLease() back to the device's pool.
+   *
+   * @param dev The target device.
+   * @param buffer The leased buffer; anything else is ignored.
+   */
+  DLLEXPORT(void) usbBufferRelease(struct USBDevice *dev, uint8 *buffer);
+
+  /**
+   * @brief Get the size of the device's library buffers, as chosen at open time.
+   *
+   * @param dev The target device.
+   * @returns The buffer size in bytes; zero if the device has no library buffers.
+   */
+  DLLEXPORT(size_t) usbBufferSize(struct USBDevice *dev);
+
   // Library gives the caller a buffer to populate...
   DLLEXPORT(USBStatus) usbBulkWriteAsyncPrepare(
     struct USBDevice *dev, uint8 **buffer,
     const char **error
   ) WARN_UNUSED_RESULT;
 
-  // ...and then submit later.
+  // ...and then submit later. A device has only one prepared buffer at a time, so threads sharing
+  // a device must not interleave their prepare/submit pairs.
   DLLEXPORT(USBStatus) usbBulkWriteAsyncSubmit(
-    struct USBDevice *dev, uint8 endpoint, uint32 length, uint32 timeout, const char **error
+    struct USBDevice *dev, uint8 endpoint, uint32 length, uint32 timeout, uint64 tag,
+    const char **error
   ) WARN_UNUSED_RESULT;
 
+  // The buffer may be NULL, to read into a library buffer of the size chosen at open time;
+  // otherwise it may be any length, as for usbBulkWriteAsync(). A library buffer's data can be
+  // read through the completion report until the next transfer is submitted on the endpoint.
   DLLEXPORT(USBStatus) usbBulkReadAsync(
-    struct USBDevice *dev, uint8 endpoint, uint8 *buffer, uint32 length, uint32 timeout, const char **error
+    struct USBDevice *dev, uint8 endpoint, uint8 *buffer, uint32 length, uint32 timeout,
+    uint64 tag, const char **error
   ) WARN_UNUSED_RESULT;
 
-  DLLEXPORT(USBStatus) usbBulkAwaitCompletion(
-    struct USBDevice *dev, struct CompletionReport *report, const char **error
+  // Interrupt equivalents of usbBulkWriteAsync() and usbBulkReadAsync(). They share the bulk
+  // transfers' queues and are awaited (or delivered to the completion callback) the same way.
+  // A read fails with USB_POLLED while usbInterruptPollStart() is polling its endpoint.
+  DLLEXPORT(USBStatus) usbInterruptWriteAsync(
+    struct USBDevice *dev, uint8 endpoint, const uint8 *buffer, uint32 length, uint32 timeout,
+    uint64 tag, const char **error
+  ) WARN_UNUSED_RESULT;
+  DLLEXPORT(USBStatus) usbInterruptReadAsync(
+    struct USBDevice *dev, uint8 endpoint, uint8 *buffer, uint32 length, uint32 timeout,
+    uint64 tag, const char **error
   ) WARN_UNUSED_RESULT;
 
-  DLLEXPORT(size_t) usbNumOutstandingRequests(
-    struct USBDevice *dev
-  );
+  /**
+   * @brief Allocate USB 3.0 bulk streams on a set of endpoints.
+   *
+   * Call this once the device is open, before submitting any stream transfers. The same stream
+   * IDs (1 to \c *numAllocated) are then valid on every endpoint in the set; typically they are
+   * the IN and OUT endpoints of one interface.
+   *
+   * @param dev The target device.
+   * @param numStreams The number of streams wanted on each endpoint.
+   * @param endpoints The endpoint addresses, including their direction bits.
+   * @param numEndpoints The number of entries in \c endpoints.
+   * @param numAllocated A pointer to be set on exit to the number of streams the host controller
+   *            actually allocated, which may be fewer than asked for.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if streams were allocated.
+   *     - \c USB_STREAMS if the device, host controller or LibUSB doesn't support streams.
+   */
+  DLLEXPORT(USBStatus) usbAllocStreams(
+    struct USBDevice *dev, uint32 numStreams, const uint8 *endpoints, int numEndpoints,
+    uint32 *numAllocated, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Free bulk streams previously allocated by \c usbAllocStreams().
+   *
+   * There must be no stream transfers in flight on the endpoints.
+   *
+   * @param dev The target device.
+   * @param endpoints The endpoint addresses, including their direction bits.
+   * @param numEndpoints The number of entries in \c endpoints.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if the streams were freed.
+   *     - \c USB_STREAMS if LibUSB couldn't free them.
+   */
+  DLLEXPORT(USBStatus) usbFreeStreams(
+    struct USBDevice *dev, const uint8 *endpoints, int numEndpoints, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Submit an async read on one stream of a bulk IN endpoint.
+   *
+   * This works like \c usbBulkReadAsync(), and the report carries the stream ID. Transfers on
+   * different streams of an endpoint share its queue but may complete in any order, so they are
+   * best awaited with \c usbBulkAwaitAnyCompletion() or a completion callback.
+   *
+   * @param dev The target device.
+   * @param endpoint The endpoint to read from.
+   * @param streamId The stream to read from, as allocated by \c usbAllocStreams().
+   * @param buffer A buffer to read into, or \c NULL to use a library buffer.
+   * @param length The number of bytes to read.
+   * @param timeout The timeout in milliseconds.
+   * @param tag A value of the caller's choosing, echoed in the completion report.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if the read was submitted.
+   *     - \c USB_ASYNC_SIZE if \c length is too big for a library buffer.
+   *     - \c USB_QUEUE_FULL if the endpoint already has the maximum number in flight.
+   *     - \c USB_ALLOC_ERR if an allocation failed.
+   *     - \c USB_ASYNC_SUBMIT if LibUSB rejected the read.
+   *     - \c USB_STREAMS if this LibUSB has no bulk streams support.
+   */
+  DLLEXPORT(USBStatus) usbBulkStreamReadAsync(
+    struct USBDevice *dev, uint8 endpoint, uint32 streamId, uint8 *buffer, uint32 length,
+    uint32 timeout, uint64 tag, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Submit an async write on one stream of a bulk OUT endpoint.
+   *
+   * This works like \c usbBulkWriteAsync(), and the report carries the stream ID. The buffer
+   * must stay valid until the write completes.
+   *
+   * @param dev The target device.
+   * @param endpoint The endpoint to write to.
+   * @param streamId The stream to write to, as allocated by \c usbAllocStreams().
+   * @param buffer The data to write.
+   * @param length The number of bytes to write.
+   * @param timeout The timeout in milliseconds.
+   * @param tag A value of the caller's choosing, echoed in the completion report.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if the write was submitted.
+   *     - \c USB_QUEUE_FULL if the endpoint already has the maximum number in flight.
+   *     - \c USB_ALLOC_ERR if an allocation failed.
+   *     - \c USB_ASYNC_SUBMIT if LibUSB rejected the write.
+   *     - \c USB_STREAMS if this LibUSB has no bulk streams support.
+   */
+  DLLEXPORT(USBStatus) usbBulkStreamWriteAsync(
+    struct USBDevice *dev, uint8 endpoint, uint32 streamId, const uint8 *buffer, uint32 length,
+    uint32 timeout, uint64 tag, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Submit an async vendor read from the control endpoint.
+   *
+   * Control transfers all go on endpoint zero's queue, so reads and writes complete in the order
+   * they were submitted; await them with \c usbBulkAwaitEndpointCompletion(dev, 0x00, ...) or
+   * any of the other await functions. The report's \c endpoint is zero, and its \c isRead flag
+   * tells reads from writes. The setup packet lives in the pooled transfer, so a burst of
+   * control transfers costs no allocations once the pool is warm.
+   *
+   * @param dev The target device.
+   * @param bRequest The request field for the setup packet.
+   * @param wValue The value field for the setup packet.
+   * @param wIndex The index field for the setup packet.
+   * @param data A buffer to receive a copy of the IN data when the transfer completes, or
+   *            \c NULL to take it from the report's \c buffer instead. It must stay valid until
+   *            the transfer completes.
+   * @param wLength The length field for the setup packet.
+   * @param timeout The timeout in milliseconds.
+   * @param tag A value of the caller's choosing, echoed in the completion report.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if the transfer was submitted.
+   *     - \c USB_QUEUE_FULL if endpoint zero already has the maximum number in flight.
+   *     - \c USB_ALLOC_ERR if an allocation failed.
+   *     - \c USB_ASYNC_SUBMIT if LibUSB rejected the transfer.
+   */
+  DLLEXPORT(USBStatus) usbControlReadAsync(
+    struct USBDevice *dev, uint8 bRequest, uint16 wValue, uint16 wIndex,
+    uint8 *data, uint16 wLength,
+    uint32 timeout, uint64 tag, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Submit an async vendor write to the control endpoint.
+   *
+   * The data is copied into the transfer, so the caller's buffer may be reused straight away.
+   * Otherwise, this works just like \c usbControlReadAsync().
+   *
+   * @param dev The target device.
+   * @param bRequest The request field for the setup packet.
+   * @param wValue The value field for the setup packet.
+   * @param wIndex The index field for the setup packet.
+   * @param data The OUT data to be sent to the device.
+   * @param wLength The length field for the setup packet. Buffer should be at least this size.
+   * @param timeout The timeout in milliseconds.
+   * @param tag A value of the caller's choosing, echoed in the completion report.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if the transfer was submitted.
+   *     - \c USB_INVALID_OPTIONS if \c data is \c NULL but \c wLength is not zero.
+   *     - \c USB_QUEUE_FULL if endpoint zero already has the maximum number in flight.
+   *     - \c USB_ALLOC_ERR if an allocation failed.
+   *     - \c USB_ASYNC_SUBMIT if LibUSB rejected the transfer.
+   */
+  DLLEXPORT(USBStatus) usbControlWriteAsync(
+    struct USBDevice *dev, uint8 bRequest, uint16 wValue, uint16 wIndex,
+    const uint8 *data, uint16 wLength,
+    uint32 timeout, uint64 tag, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Submit an async isochronous transfer.
+   *
+   * The transfer is \c numPackets packets of \c packetSize bytes each, packed one after
+   * another in the buffer. It's awaited (or delivered to the completion callback) like any other
+   * async transfer; the report's \c packets array gives each packet's offset, actual length and
+   * status, and its \c actualLength is the total over all packets. The overall status only
+   * reflects failures of the transfer as a whole; individual packets may fail regardless.
+   *
+   * @param dev The target device.
+   * @param endpoint The endpoint address, including the direction bit.
+   * @param buffer The data to write, or space to read into; \c NULL to use a library buffer.
+   * @param numPackets The number of packets in the transfer.
+   * @param packetSize The size of each packet, usually the endpoint's max packet size.
+   * @param timeout The timeout in milliseconds.
+   * @param tag A value of the caller's choosing, echoed in the completion report.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if the transfer was submitted.
+   *     - \c USB_INVALID_OPTIONS if \c numPackets or \c packetSize is zero.
+   *     - \c USB_ASYNC_SIZE if a library buffer is too small, or the transfer is too big for
+   *       LibUSB.
+   *     - \c USB_ALLOC_ERR if an allocation failed.
+   *     - \c USB_ASYNC_SUBMIT if LibUSB rejected the transfer.
+   */
+  DLLEXPORT(USBStatus) usbIsoTransferAsync(
+    struct USBDevice *dev, uint8 endpoint, uint8 *buffer, uint32 numPackets, uint32 packetSize,
+    uint32 timeout, uint64 tag, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Keep an interrupt IN endpoint permanently armed.
+   *
+   * Submits an async interrupt read of up to \c length bytes into a library buffer, and
+   * re-arms the endpoint with another as each one completes, from the completion itself. Each
+   * read is reported like any other async transfer, with \c flags.isPoll set, so device events
+   * arrive without polling over the control endpoint. Polling stops after a read fails, or if
+   * the next read can't be submitted (e.g. \c USB_QUEUE_FULL); the last read is reported with
+   * \c flags.pollStopped set, and polling may then be restarted. Starting an endpoint that is
+   * already being polled does nothing.
+   *
+   * While the endpoint is being polled, no other reads may be submitted on it; they fail with
+   * \c USB_POLLED. A read still armed is not counted by \c usbNumOutstandingRequests(), and is
+   * passed over by \c usbBulkAwaitCompletion(), \c usbBulkAwaitAnyCompletion() and
+   * \c usbBulkAwaitCompletions() until it completes; to wait for it, use
+   * \c usbBulkAwaitEndpointCompletion() or a completion callback.
+   *
+   * @param dev The target device.
+   * @param endpoint The interrupt endpoint to poll.
+   * @param length The size of each read; at most the buffer size chosen at open time.
+   * @param timeout The timeout of each read in milliseconds, or zero for none.
+   * @param tag A value of the caller's choosing, echoed in the report of every read.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if the endpoint is being polled.
+   *     - \c USB_ASYNC_SIZE if \c length exceeds the library buffer size.
+   *     - \c USB_ALLOC_ERR if an allocation failed.
+   *     - \c USB_ASYNC_SUBMIT if LibUSB rejected the read.
+   */
+  DLLEXPORT(USBStatus) usbInterruptPollStart(
+    struct USBDevice *dev, uint8 endpoint, uint32 length, uint32 timeout,
+    uint64 tag, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Stop polling an interrupt IN endpoint.
+   *
+   * The armed read is cancelled, and is reported as failed once the cancellation completes.
+   *
+   * @param dev The target device.
+   * @param endpoint The interrupt endpoint being polled.
+   */
+  DLLEXPORT(void) usbInterruptPollStop(struct USBDevice *dev, uint8 endpoint);
+
+  /**
+   * @brief Submit several async bulk transfers in one go.
+   *
+   * The requests are submitted in order, as if by \c usbBulkWriteAsync() and
+   * \c usbBulkReadAsync(), but all the queue space they need is reserved up-front with the device
+   * lock held throughout. So running out of queue space submits nothing, whereas a later failure
+   * (allocating a library buffer, or a LibUSB submission error) leaves the earlier requests in
+   * flight, to be awaited as normal.
+   *
+   * @param dev The target device.
+   * @param requests The transfers to submit.
+   * @param count The number of transfers in \c requests.
+   * @param numSubmitted A pointer to a \c size_t to be set on exit to the number of transfers
+   *            actually submitted.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if all the transfers were submitted.
+   *     - \c USB_ASYNC_SIZE if any of the transfers is too large (nothing is submitted).
+   *     - \c USB_QUEUE_FULL if the batch would exceed an endpoint's maximum depth (nothing is
+   *       submitted).
+   *     - \c USB_ALLOC_ERR if queue space or a library buffer could not be allocated.
+   *     - \c USB_ASYNC_SUBMIT if LibUSB rejected one of the transfers.
+   */
+  DLLEXPORT(USBStatus) usbBulkSubmitBatch(
+    struct USBDevice *dev, const struct BulkTransferRequest *requests, size_t count,
+    size_t *numSubmitted, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  DLLEXPORT(USBStatus) usbBulkAwaitCompletion(
+    struct USBDevice *dev, struct CompletionReport *report, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Await the oldest outstanding transfer, giving up after a timeout.
+   *
+   * This is \c usbBulkAwaitCompletion() with a bound on how long to wait. If the transfer has
+   * not completed in time, it is left at the head of the queue to be awaited again later. A
+   * timeout of zero just handles any pending events and checks, without blocking.
+   *
+   * @param dev The target device.
+   * @param report A pointer to a \c CompletionReport to be populated on exit.
+   * @param timeout The maximum time to wait in milliseconds, or \c USB_WAIT_FOREVER.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if the transfer completed successfully.
+   *     - \c USB_PENDING if the transfer has not completed yet (no error message is allocated).
+   *     - \c USB_EMPTY_QUEUE if there are no outstanding transfers.
+   *     - \c USB_TIMEOUT if the transfer itself timed out.
+   *     - \c USB_ASYNC_TRANSFER if the transfer failed.
+   *     - \c USB_ASYNC_EVENT if LibUSB event-handling failed.
+   */
+  DLLEXPORT(USBStatus) usbBulkAwaitCompletionTimeout(
+    struct USBDevice *dev, struct CompletionReport *report, uint32 timeout, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Await the oldest outstanding transfer on a particular endpoint.
+   *
+   * Each endpoint has its own queue of outstanding transfers, so this only waits for transfers
+   * on the given endpoint, and may be called from a different thread for each endpoint.
+   *
+   * @param dev The target device.
+   * @param endpoint The endpoint address, including the direction bit (e.g 0x86 for EP6IN).
+   * @param report A pointer to a \c CompletionReport to be populated on exit.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if the transfer completed successfully.
+   *     - \c USB_EMPTY_QUEUE if there are no outstanding transfers on the endpoint.
+   *     - \c USB_TIMEOUT if the transfer timed out.
+   *     - \c USB_ASYNC_TRANSFER if the transfer failed.
+   *     - \c USB_ASYNC_EVENT if LibUSB event-handling failed.
+   */
+  DLLEXPORT(USBStatus) usbBulkAwaitEndpointCompletion(
+    struct USBDevice *dev, uint8 endpoint, struct CompletionReport *report, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Await whichever outstanding transfer completes first.
+   *
+   * Unlike \c usbBulkAwaitCompletion(), which always reaps transfers in the order they were
+   * submitted, this returns the transfer that finished earliest, regardless of its position in
+   * the queue. Use the report's \c id and \c endpoint fields to tell which one it was. The two
+   * calls may be mixed, but not concurrently on the same device.
+   *
+   * @param dev The target device.
+   * @param report A pointer to a \c CompletionReport to be populated on exit.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if a transfer completed successfully.
+   *     - \c USB_EMPTY_QUEUE if there are no outstanding transfers.
+   *     - \c USB_TIMEOUT if the completed transfer timed out.
+   *     - \c USB_ASYNC_TRANSFER if the completed transfer failed.
+   *     - \c USB_ASYNC_EVENT if LibUSB event-handling failed.
+   */
+  DLLEXPORT(USBStatus) usbBulkAwaitAnyCompletion(
+    struct USBDevice *dev, struct CompletionReport *report, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Await a batch of completed transfers.
+   *
+   * Wait until at least \c minCount outstanding transfers have completed, or until the timeout
+   * expires, then report up to \c maxCount of the completed transfers in the order they
+   * completed, all with one acquisition of the device lock. If a transfer failed, it is the
+   * last one reported, and its status is returned.
+   *
+   * @param dev The target device.
+   * @param reports An array of at least \c maxCount reports to be populated on exit.
+   * @param minCount The number of completions to wait for. If there are fewer transfers
+   *            outstanding, wait for them all.
+   * @param maxCount The maximum number of completions to report.
+   * @param timeout The maximum time to wait in milliseconds, or \c USB_WAIT_FOREVER. If it
+   *            expires, the transfers which have completed so far (if any) are reported. If
+   *            \c minCount transfers have already completed, they're reported straight away
+   *            without handling any events; otherwise, even with a zero timeout, pending events
+   *            are handled once first.
+   * @param numReports A pointer to a \c size_t to be set on exit to the number of reports.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if the reported transfers all completed successfully.
+   *     - \c USB_EMPTY_QUEUE if there are no outstanding transfers.
+   *     - \c USB_TIMEOUT if the last reported transfer timed out.
+   *     - \c USB_ASYNC_TRANSFER if the last reported transfer failed.
+   *     - \c USB_ASYNC_EVENT if LibUSB event-handling failed.
+   */
+  DLLEXPORT(USBStatus) usbBulkAwaitCompletions(
+    struct USBDevice *dev, struct CompletionReport *reports, size_t minCount, size_t maxCount,
+    uint32 timeout, size_t *numReports, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  DLLEXPORT(size_t) usbNumOutstandingRequests(
+    struct USBDevice *dev
+  );
+
+  /**
+   * @brief Cancel every outstanding transfer on a device, or on one of its endpoints.
+   *
+   * All the selected transfers are cancelled together, then reaped as LibUSB finishes with them,
+   * so this takes about one round of event handling rather than a transfer timeout each. Any
+   * interrupt polling on the selected endpoints is stopped. The transfers are retired without
+   * being reported, either to awaits or to the completion callback; no other thread may be
+   * awaiting completions on the device meanwhile. Streams are not affected. This is done
+   * automatically by \c usbCloseDevice().
+   *
+   * @param dev The target device.
+   * @param endpoint The endpoint address, including the direction bit, or \c USB_ALL_ENDPOINTS.
+   * @param report A pointer to a \c DrainReport to be populated on exit with how the transfers
+   *            ended, or \c NULL.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if every selected transfer was reaped.
+   *     - \c USB_ASYNC_EVENT if LibUSB event-handling failed.
+   */
+  DLLEXPORT(USBStatus) usbCancelAll(
+    struct USBDevice *dev, uint8 endpoint, struct DrainReport *report, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Start a background thread to handle LibUSB events in the default context.
+   *
+   * Without this thread, async transfers only make progress while some thread is blocked in
+   * \c usbBulkAwaitCompletion(). With it, transfers complete as soon as the hardware finishes
+   * them; \c usbBulkAwaitCompletion() just sleeps until the event thread reports a completion,
+   * and completion callbacks are invoked on the event thread. If LibUSB event-handling fails in
+   * the thread, it exits rather than spin, and waiting threads handle events themselves again;
+   * calling this again starts a new one.
+   *
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if the thread was started, or was already running.
+   *     - \c USB_INIT if \c usbInitialise() has not been called.
+   *     - \c USB_THREAD if the thread could not be created, or is still being stopped.
+   */
+  DLLEXPORT(USBStatus) usbEventThreadStart(
+    const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Stop the background event-handling thread, if it is running.
+   *
+   * This is called automatically by \c usbShutdown().
+   */
+  DLLEXPORT(void) usbEventThreadStop(void);
+
+  /**
+   * @brief Start a background thread to handle a context's events, as \c usbEventThreadStart()
+   * does for the default context.
+   *
+   * @param ctx The context from \c usbContextCreate(), or \c NULL for the default context.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if the thread was started, or was already running.
+   *     - \c USB_INIT if \c ctx is \c NULL and \c usbInitialise() has not been called.
+   *     - \c USB_THREAD if the thread could not be created, or is still being stopped.
+   */
+  DLLEXPORT(USBStatus) usbContextEventThreadStart(
+    struct USBContext *ctx, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Stop a context's event thread, if it is running.
+   *
+   * Threads already waiting for completions on the context's devices notice within a tenth of a
+   * second, and carry on handling events themselves. This is called automatically by
+   * \c usbContextDestroy(). Called from a completion callback, it can't wait for the thread it's
+   * running on, so it just asks it to stop, and returns.
+   *
+   * @param ctx The context from \c usbContextCreate(), or \c NULL for the default context.
+   */
+  DLLEXPORT(void) usbContextEventThreadStop(struct USBContext *ctx);
+
+  /**
+   * @brief Get the file descriptors the default context needs watched, for an application's own
+   * event loop.
+   *
+   * This is the alternative to \c usbEventThreadStart() for an application which already
+   * multiplexes its I/O with \c poll(), \c epoll or similar: it watches these descriptors
+   * alongside its own, and calls \c usbHandleEventsNow() when any is ready, or when the
+   * deadline from \c usbGetNextTimeout() passes. Completions are best collected with
+   * \c usbSetCompletionCallback(), which makes \c usbHandleEventsNow() deliver them. The set can
+   * change as devices are opened and closed; use \c usbSetPollFdNotifiers() to follow it.
+   *
+   * @param fds An array to receive the descriptors.
+   * @param maxFds The capacity of \c fds.
+   * @param numFds Set on exit to the number of descriptors LibUSB has, which may exceed
+   *            \c maxFds, in which case only the first \c maxFds are returned.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if the descriptors were returned.
+   *     - \c USB_INIT if \c usbInitialise() has not been called.
+   *     - \c USB_ASYNC_EVENT if LibUSB cannot supply them, as on Windows.
+   */
+  DLLEXPORT(USBStatus) usbGetPollFds(
+    struct USBPollFd *fds, size_t maxFds, size_t *numFds, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Get the file descriptors a context needs watched, as \c usbGetPollFds() does for the
+   * default context.
+   *
+   * @param ctx The context from \c usbContextCreate(), or \c NULL for the default context.
+   * @param fds An array to receive the descriptors.
+   * @param maxFds The capacity of \c fds.
+   * @param numFds Set on exit to the number of descriptors LibUSB has, which may exceed
+   *            \c maxFds, in which case only the first \c maxFds are returned.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if the descriptors were returned.
+   *     - \c USB_INIT if \c ctx is \c NULL and \c usbInitialise() has not been called.
+   *     - \c USB_ASYNC_EVENT if LibUSB cannot supply them, as on Windows.
+   */
+  DLLEXPORT(USBStatus) usbContextGetPollFds(
+    struct USBContext *ctx, struct USBPollFd *fds, size_t maxFds, size_t *numFds,
+    const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Register callbacks for when LibUSB starts or stops needing a file descriptor watched.
+   *
+   * The callbacks may be invoked from within any library call, on the calling thread.
+   *
+   * @param added Called with each new descriptor and the events to watch it for, or \c NULL.
+   * @param removed Called with each descriptor which should no longer be watched, or \c NULL.
+   * @param userData An opaque pointer passed through to the callbacks.
+   */
+  DLLEXPORT(void) usbSetPollFdNotifiers(
+    USBPollFdAddedCallback added, USBPollFdRemovedCallback removed, void *userData
+  );
+
+  /**
+   * @brief Register a context's file descriptor callbacks, as \c usbSetPollFdNotifiers() does
+   * for the default context.
+   *
+   * Each context keeps its own callbacks, so several event loops can each follow their own.
+   *
+   * @param ctx The context from \c usbContextCreate(), or \c NULL for the default context.
+   * @param added Called with each new descriptor and the events to watch it for, or \c NULL.
+   * @param removed Called with each descriptor which should no longer be watched, or \c NULL.
+   * @param userData An opaque pointer passed through to the callbacks.
+   */
+  DLLEXPORT(void) usbContextSetPollFdNotifiers(
+    struct USBContext *ctx, USBPollFdAddedCallback added, USBPollFdRemovedCallback removed,
+    void *userData
+  );
+
+  /**
+   * @brief Get how long an application's event loop may wait before calling
+   * \c usbHandleEventsNow() anyway, so LibUSB can expire timed-out transfers.
+   *
+   * @param timeout Set on exit to the number of milliseconds until LibUSB's next deadline, or to
+   *            \c USB_WAIT_FOREVER if it has none, or if its descriptors signal their own
+   *            timeouts.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if the timeout was returned.
+   *     - \c USB_INIT if \c usbInitialise() has not been called.
+   *     - \c USB_ASYNC_EVENT if LibUSB could not determine it.
+   */
+  DLLEXPORT(USBStatus) usbGetNextTimeout(
+    uint32 *timeout, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Get how long a context's event loop may wait, as \c usbGetNextTimeout() does for the
+   * default context.
+   *
+   * @param ctx The context from \c usbContextCreate(), or \c NULL for the default context.
+   * @param timeout Set on exit to the number of milliseconds until LibUSB's next deadline, or to
+   *            \c USB_WAIT_FOREVER if it has none, or if its descriptors signal their own
+   *            timeouts.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if the timeout was returned.
+   *     - \c USB_INIT if \c ctx is \c NULL and \c usbInitialise() has not been called.
+   *     - \c USB_ASYNC_EVENT if LibUSB could not determine it.
+   */
+  DLLEXPORT(USBStatus) usbContextGetNextTimeout(
+    struct USBContext *ctx, uint32 *timeout, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Handle whatever LibUSB events are ready, without blocking.
+   *
+   * Call this when one of the descriptors from \c usbGetPollFds() is ready, or the timeout from
+   * \c usbGetNextTimeout() has passed. Completion callbacks are invoked from within it; without
+   * a callback, finished transfers can be collected with a zero-timeout
+   * \c usbBulkAwaitCompletionTimeout(). Don't use it while the event thread is running.
+   *
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if the ready events were handled.
+   *     - \c USB_INIT if \c usbInitialise() has not been called.
+   *     - \c USB_ASYNC_EVENT if LibUSB event-handling failed.
+   */
+  DLLEXPORT(USBStatus) usbHandleEventsNow(
+    const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Handle whatever events are ready on a context, without blocking, as
+   * \c usbHandleEventsNow() does for the default context.
+   *
+   * Don't use it while the context's event thread is running.
+   *
+   * @param ctx The context from \c usbContextCreate(), or \c NULL for the default context.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if the ready events were handled.
+   *     - \c USB_INIT if \c ctx is \c NULL and \c usbInitialise() has not been called.
+   *     - \c USB_ASYNC_EVENT if LibUSB event-handling failed.
+   */
+  DLLEXPORT(USBStatus) usbContextHandleEventsNow(
+    struct USBContext *ctx, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Deliver a device's async completions to a callback rather than to
+   * \c usbBulkAwaitCompletion().
+   *
+   * The callback is invoked from whichever thread is handling LibUSB events (normally the thread
+   * started by \c usbEventThreadStart()), as soon as each transfer completes; transfers that had
+   * already completed are delivered by this call. Each endpoint's transfers are delivered in the
+   * order they were submitted on that endpoint, but there is no ordering between endpoints. The
+   * report is only valid for the duration of the callback. The callback may submit new
+   * transfers on the device, but must not await completions on it. It may stop the event thread
+   * it runs on, but must not close the device, or destroy or shut down its context.
+   *
+   * @param dev The target device.
+   * @param callback The function to call, or \c NULL to revert to \c usbBulkAwaitCompletion().
+   * @param userData An opaque pointer passed through to the callback.
+   */
+  DLLEXPORT(void) usbSetCompletionCallback(
+    struct USBDevice *dev, USBCompletionCallback callback, void *userData
+  );
+
+  /**
+   * @brief Set an endpoint's policy for recovering from stalls.
+   *
+   * By default a stalled transfer completes with \c USB_ASYNC_TRANSFER like any other failure, and
+   * everything queued behind it on the endpoint is stuck until the halt is cleared. With a nonzero
+   * retry limit, a bulk or interrupt transfer that stalls before moving any data is instead held
+   * back without being reported, the transfers behind it are cancelled, the halt is cleared, and
+   * they are all resubmitted in their original order, followed by anything submitted on the
+   * endpoint in the meantime. This happens in the completion path, so it needs no help from the
+   * application. A transfer that stalls more than \c maxRetries times, or after moving part of its
+   * data, fails as before.
+   *
+   * @param dev The target device.
+   * @param endpoint The endpoint address, including the direction bit.
+   * @param maxRetries How many times each transfer may be resubmitted; zero disables recovery.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if the policy was set.
+   *     - \c USB_INVALID_OPTIONS if \c endpoint is the control endpoint.
+   */
+  DLLEXPORT(USBStatus) usbSetStallPolicy(
+    struct USBDevice *dev, uint8 endpoint, uint32 maxRetries, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Get an endpoint's stall history.
+   *
+   * @param dev The target device.
+   * @param endpoint The endpoint address, including the direction bit.
+   * @param stats A pointer to a \c StallStats to be populated on exit.
+   */
+  DLLEXPORT(void) usbGetStallStats(
+    struct USBDevice *dev, uint8 endpoint, struct StallStats *stats
+  );
+
+  /**
+   * @brief Start reading continuously from an IN endpoint.
+   *
+   * Keeps \c depth reads of \c transferSize bytes in flight on the endpoint. Each read is
+   * resubmitted with a fresh buffer from its own completion, without waiting for the consumer,
+   * and its filled buffer is queued in a ring for \c usbStreamReadAwait(). There are twice as
+   * many buffers as reads; if the consumer falls behind by that much, reads are held back until
+   * it catches up. A failed read stops the stream. Stream transfers are not counted by
+   * \c usbNumOutstandingRequests(), and the stream must be stopped before the device is closed.
+   *
+   * @param dev The target device.
+   * @param endpoint The endpoint to read from.
+   * @param depth The number of reads to keep in flight.
+   * @param transferSize The size of each read, and of each buffer.
+   * @param timeout The timeout of each read in milliseconds, or zero for none.
+   * @param streamPtr A pointer to a <code>struct USBReadStream*</code> to be set on exit to the
+   *            new stream.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if the stream was started.
+   *     - \c USB_INVALID_OPTIONS if \c depth or \c transferSize is zero.
+   *     - \c USB_ALLOC_ERR if the transfers or buffers could not be allocated.
+   *     - \c USB_ASYNC_SUBMIT if LibUSB rejected one of the reads.
+   */
+  DLLEXPORT(USBStatus) usbStreamReadStart(
+    struct USBDevice *dev, uint8 endpoint, size_t depth, uint32 transferSize, uint32 timeout,
+    struct USBReadStream **streamPtr, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Start capturing continuously from an isochronous IN endpoint.
+   *
+   * Works exactly as \c usbStreamReadStart(), except that each of the \c depth transfers is
+   * \c numPackets packets of the endpoint's max isochronous packet size. The reports from
+   * \c usbStreamReadAwait() carry per-packet results, valid as long as the buffer is. Failed
+   * packets don't stop the stream; only a failure of a whole transfer does.
+   *
+   * @param dev The target device.
+   * @param endpoint The endpoint to read from.
+   * @param depth The number of transfers to keep in flight.
+   * @param numPackets The number of packets in each transfer.
+   * @param timeout The timeout of each transfer in milliseconds, or zero for none.
+   * @param streamPtr A pointer to a <code>struct USBReadStream*</code> to be set on exit to the
+   *            new stream.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - The same codes as \c usbStreamReadStart().
+   *     - \c USB_CANNOT_GET_DESCRIPTOR if the endpoint's packet size is unavailable.
+   *     - \c USB_ASYNC_SIZE if each transfer would be too big for LibUSB.
+   */
+  DLLEXPORT(USBStatus) usbStreamIsoReadStart(
+    struct USBDevice *dev, uint8 endpoint, size_t depth, uint32 numPackets, uint32 timeout,
+    struct USBReadStream **streamPtr, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Take the next filled buffer from a read stream.
+   *
+   * Buffers are returned in the order the data arrived. The report's buffer remains valid until
+   * the next call on the stream, which gives it back to be read into again.
+   *
+   * @param stream The stream.
+   * @param report A pointer to a \c CompletionReport to be populated; its \c id counts the
+   *            buffers delivered by the stream.
+   * @param timeout Milliseconds to wait; zero polls, and \c USB_WAIT_FOREVER waits indefinitely.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if a buffer was filled.
+   *     - \c USB_PENDING if nothing arrived before the timeout; no message is rendered.
+   *     - \c USB_TIMEOUT or \c USB_ASYNC_TRANSFER if the read into this buffer failed, which
+   *       stops the stream; later calls return \c USB_ASYNC_TRANSFER once the ring is empty.
+   *     - \c USB_ASYNC_EVENT if LibUSB event handling failed.
+   */
+  DLLEXPORT(USBStatus) usbStreamReadAwait(
+    struct USBReadStream *stream, struct CompletionReport *report, uint32 timeout,
+    const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Stop a read stream, cancelling its reads, and free it.
+   *
+   * Data not yet taken with \c usbStreamReadAwait() is discarded. If LibUSB event-handling
+   * fails before every read has come back, the stream is leaked rather than freed while LibUSB
+   * still owns some of its transfers.
+   *
+   * @param stream The stream, or \c NULL to do nothing.
+   */
+  DLLEXPORT(void) usbStreamReadStop(struct USBReadStream *stream);
+
+  /**
+   * @brief Start a stream of writes to an OUT endpoint.
+   *
+   * Bytes appended with \c usbStreamWrite() are packed into buffers of \c transferSize bytes,
+   * with up to \c depth of them in flight at once. A full buffer is submitted straight away. A
+   * partly-packed buffer is submitted as soon as the pipe would otherwise go idle, or once its
+   * first byte has waited \c latency milliseconds; the deadline is checked whenever bytes are
+   * appended or a write completes. So a sustained stream goes out in whole buffers, while a
+   * short burst goes out promptly. A failed write stops the stream. Stream transfers are not
+   * counted by \c usbNumOutstandingRequests(), and the stream must be stopped before the device
+   * is closed.
+   *
+   * @param dev The target device.
+   * @param endpoint The endpoint to write to.
+   * @param depth The most writes to have in flight.
+   * @param transferSize The size of each buffer.
+   * @param latency How long in milliseconds a partly-packed buffer may wait while the pipe is
+   *            busy.
+   * @param timeout The timeout of each write in milliseconds, or zero for none.
+   * @param streamPtr A pointer to a <code>struct USBWriteStream*</code> to be set on exit to
+   *            the new stream.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if the stream was started.
+   *     - \c USB_INVALID_OPTIONS if \c depth or \c transferSize is zero.
+   *     - \c USB_ALLOC_ERR if the transfers or buffers could not be allocated.
+   */
+  DLLEXPORT(USBStatus) usbStreamWriteStart(
+    struct USBDevice *dev, uint8 endpoint, size_t depth, uint32 transferSize, uint32 latency,
+    uint32 timeout, struct USBWriteStream **streamPtr, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Append bytes to a write stream.
+   *
+   * The bytes are copied, so the caller's buffer may be reused as soon as this returns. If every
+   * buffer is full or in flight, this blocks until a write completes.
+   *
+   * @param stream The stream.
+   * @param data The bytes to append.
+   * @param length The number of bytes to append.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if the bytes were appended.
+   *     - \c USB_TIMEOUT or \c USB_ASYNC_TRANSFER if the stream has stopped after a failed write.
+   *     - \c USB_ASYNC_EVENT if LibUSB event handling failed.
+   */
+  DLLEXPORT(USBStatus) usbStreamWrite(
+    struct USBWriteStream *stream, const uint8 *data, uint32 length, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Submit any partly-packed buffer, and wait for all the stream's writes to complete.
+   *
+   * @param stream The stream.
+   * @param error A pointer to a <code>char*</code> which will be set on exit to an allocated
+   *            error message if something goes wrong. Responsibility for this allocated memory
+   *            passes to the caller and must be freed with \c usbFreeError(). If \c error is
+   *            \c NULL, no allocation is done and no message is returned, but the return code
+   *            will still be valid.
+   * @returns
+   *     - \c USB_SUCCESS if everything appended so far has been written.
+   *     - \c USB_TIMEOUT or \c USB_ASYNC_TRANSFER if the stream has stopped after a failed write.
+   *     - \c USB_ASYNC_EVENT if LibUSB event handling failed.
+   */
+  DLLEXPORT(USBStatus) usbStreamWriteFlush(
+    struct USBWriteStream *stream, const char **error
+  ) WARN_UNUSED_RESULT;
+
+  /**
+   * @brief Stop a write stream, cancelling its writes, and free it.
+   *
+   * Bytes not yet written are discarded; call \c usbStreamWriteFlush() first to keep them. If
+   * LibUSB event-handling fails before every write has come back, the stream is leaked rather
+   * than freed while LibUSB still owns some of its transfers.
+   *
+   * @param stream The stream, or \c NULL to do nothing.
+   */
+  DLLEXPORT(void) usbStreamWriteStop(struct USBWriteStream *stream);
   //@}
 
 #ifdef __cplusplus
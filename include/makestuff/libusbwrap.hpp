@@ -0,0 +1,342 @@
+/*
+ * Copyright (C) 2009-2012 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file libusbwrap.hpp
+ *
+ * Header-only C++20 RAII wrapper over the C API. Devices, library buffers and completed
+ * transfers are move-only objects which release what they own on destruction, so ownership of
+ * a buffer full of data can be handed down a processing pipeline without copying it out:
+ *
+ * @code
+ * makestuff::usb::Device dev("1d50:602b", 1, 0, 0);
+ * dev.bulkReadAsync(0x86, dev.lease(), 0x10000, 9000);
+ * makestuff::usb::Transfer t = dev.await();
+ * if (t) {
+ *   pipeline.push(std::move(t).buffer());  // the data stays where the device put it
+ * }
+ * @endcode
+ *
+ * Errors from opening, submitting and synchronous I/O are thrown as \c makestuff::usb::Error.
+ * A transfer which was submitted but then failed is not an exception; its status is in the
+ * \c Transfer.
+ */
+#ifndef LIBUSBWRAP_HPP
+#define LIBUSBWRAP_HPP
+
+#include <makestuff/libusbwrap.h>
+#include <cstddef>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace makestuff::usb {
+
+  /**
+   * A failure reported by the library, with its status code.
+   */
+  class Error : public std::runtime_error {
+  public:
+    Error(USBStatus status, const std::string &message) :
+      std::runtime_error(message), m_status(status) { }
+    USBStatus status() const noexcept { return m_status; }
+  private:
+    USBStatus m_status;
+  };
+
+  namespace detail {
+    // Throw if a call failed, taking ownership of its error message.
+    inline void check(USBStatus status, const char *error) {
+      if (status != USB_SUCCESS) {
+        std::string message = error ? error : "libusbwrap: unknown error";
+        if (error) {
+          usbFreeError(error);
+        }
+        throw Error(status, message);
+      }
+    }
+  }
+
+  /**
+   * A library buffer leased from a device's pool, given back on destruction. It must not outlive
+   * its \c Device.
+   */
+  class Buffer {
+  public:
+    Buffer() noexcept = default;
+    Buffer(Buffer &&other) noexcept :
+      m_dev(other.m_dev), m_data(std::exchange(other.m_data, nullptr)), m_size(other.m_size) { }
+    Buffer &operator=(Buffer &&other) noexcept {
+      if (this != &other) {
+        reset();
+        m_dev = other.m_dev;
+        m_data = std::exchange(other.m_data, nullptr);
+        m_size = other.m_size;
+      }
+      return *this;
+    }
+    Buffer(const Buffer &) = delete;
+    Buffer &operator=(const Buffer &) = delete;
+    ~Buffer() { reset(); }
+
+    std::span<uint8> span() noexcept { return {m_data, m_data ? m_size : 0}; }
+    std::span<const uint8> span() const noexcept { return {m_data, m_data ? m_size : 0}; }
+    uint8 *data() noexcept { return m_data; }
+    const uint8 *data() const noexcept { return m_data; }
+    size_t size() const noexcept { return m_data ? m_size : 0; }
+    explicit operator bool() const noexcept { return m_data != nullptr; }
+
+    /// Give the buffer back to the pool now.
+    void reset() noexcept {
+      if (m_data) {
+        usbBufferRelease(m_dev, std::exchange(m_data, nullptr));
+      }
+    }
+
+  private:
+    friend class Device;
+    Buffer(USBDevice *dev, uint8 *data, size_t size) noexcept :
+      m_dev(dev), m_data(data), m_size(size) { }
+    USBDevice *m_dev = nullptr;
+    uint8 *m_data = nullptr;
+    size_t m_size = 0;
+  };
+
+  /**
+   * A completed async transfer. If it was submitted with a leased \c Buffer, the buffer comes
+   * back with it.
+   */
+  class Transfer {
+  public:
+    Transfer(Transfer &&) noexcept = default;
+    Transfer &operator=(Transfer &&) noexcept = default;
+    Transfer(const Transfer &) = delete;
+    Transfer &operator=(const Transfer &) = delete;
+
+    /// \c USB_SUCCESS, \c USB_TIMEOUT or \c USB_ASYNC_TRANSFER.
+    USBStatus status() const noexcept { return m_status; }
+    explicit operator bool() const noexcept { return m_status == USB_SUCCESS; }
+    const CompletionReport &report() const noexcept { return m_report; }
+    uint64 tag() const noexcept { return m_report.tag; }
+    uint8 endpoint() const noexcept { return m_report.endpoint; }
+
+    /// The bytes actually transferred. For a leased-buffer transfer, valid while its buffer
+    /// lives; for a library-buffer read, only until the next submission on the same endpoint.
+    std::span<const uint8> data() const noexcept {
+      return {m_report.buffer, m_report.actualLength};
+    }
+
+    /// Take the leased buffer the transfer used, if any.
+    Buffer buffer() && noexcept { return std::move(m_buffer); }
+
+  private:
+    friend class Device;
+    Transfer(USBStatus status, const CompletionReport &report, Buffer buffer) noexcept :
+      m_status(status), m_report(report), m_buffer(std::move(buffer)) { }
+    USBStatus m_status;
+    CompletionReport m_report;
+    Buffer m_buffer;
+  };
+
+  /**
+   * An open device. It remembers the interface it claimed, and closes itself on destruction,
+   * cancelling anything still in flight. It's opened in the default context unless another is
+   * given.
+   */
+  class Device {
+  public:
+    Device(
+      const char *vp, int configuration, int iface, int alternateInterface,
+      const USBOpenOptions *options = nullptr, USBContext *ctx = nullptr) : m_iface(iface)
+    {
+      const char *error = nullptr;
+      const USBStatus status = usbOpenDeviceInContext(
+        ctx, vp, configuration, iface, alternateInterface, options, &m_dev, &error);
+      detail::check(status, error);
+    }
+    Device(Device &&other) noexcept :
+      m_dev(std::exchange(other.m_dev, nullptr)), m_iface(other.m_iface),
+      m_inFlight(std::move(other.m_inFlight)) { }
+    Device &operator=(Device &&other) noexcept {
+      if (this != &other) {
+        close();
+        m_dev = std::exchange(other.m_dev, nullptr);
+        m_iface = other.m_iface;
+        m_inFlight = std::move(other.m_inFlight);
+      }
+      return *this;
+    }
+    Device(const Device &) = delete;
+    Device &operator=(const Device &) = delete;
+    ~Device() { close(); }
+
+    /// The underlying handle, for calls this wrapper doesn't cover.
+    USBDevice *get() const noexcept { return m_dev; }
+
+    /// Cancel anything in flight, give back the buffers it was using, and close the device. If
+    /// the cancellation fails, LibUSB may still be using those buffers, so they're leaked.
+    void close() noexcept {
+      if (m_dev) {
+        if (usbCancelAll(m_dev, USB_ALL_ENDPOINTS, nullptr, nullptr) != USB_SUCCESS) {
+          for (auto &entry : m_inFlight) {
+            entry.second.m_data = nullptr;
+          }
+        }
+        m_inFlight.clear();
+        usbCloseDevice(std::exchange(m_dev, nullptr), m_iface);
+      }
+    }
+
+    /// Lease a library buffer from the device's pool.
+    Buffer lease() {
+      const char *error = nullptr;
+      uint8 *data = nullptr;
+      detail::check(usbBufferLease(m_dev, &data, &error), error);
+      return Buffer(m_dev, data, usbBufferSize(m_dev));
+    }
+
+    void controlRead(
+      uint8 bRequest, uint16 wValue, uint16 wIndex, std::span<uint8> data, uint32 timeout)
+    {
+      const char *error = nullptr;
+      const USBStatus status = usbControlRead(
+        m_dev, bRequest, wValue, wIndex, data.data(), (uint16)data.size(), timeout, &error);
+      detail::check(status, error);
+    }
+
+    void controlWrite(
+      uint8 bRequest, uint16 wValue, uint16 wIndex, std::span<const uint8> data, uint32 timeout)
+    {
+      const char *error = nullptr;
+      const USBStatus status = usbControlWrite(
+        m_dev, bRequest, wValue, wIndex, data.data(), (uint16)data.size(), timeout, &error);
+      detail::check(status, error);
+    }
+
+    void bulkRead(uint8 endpoint, std::span<uint8> data, uint32 timeout) {
+      const char *error = nullptr;
+      const USBStatus status = usbBulkRead(
+        m_dev, endpoint, data.data(), (uint32)data.size(), timeout, &error);
+      detail::check(status, error);
+    }
+
+    void bulkWrite(uint8 endpoint, std::span<const uint8> data, uint32 timeout) {
+      const char *error = nullptr;
+      const USBStatus status = usbBulkWrite(
+        m_dev, endpoint, data.data(), (uint32)data.size(), timeout, &error);
+      detail::check(status, error);
+    }
+
+    /// Read into a leased buffer, which comes back with the completed \c Transfer. The buffer
+    /// must not be empty, and must hold at least \c length bytes.
+    void bulkReadAsync(uint8 endpoint, Buffer buffer, uint32 length, uint32 timeout, uint64 tag = 0) {
+      checkLease(buffer, length, "bulkReadAsync");
+      const char *error = nullptr;
+      const USBStatus status = usbBulkReadAsync(
+        m_dev, endpoint, buffer.data(), length, timeout, tag, &error);
+      detail::check(status, error);
+      m_inFlight.emplace(buffer.data(), std::move(buffer));
+    }
+
+    /// Write the first \c length bytes of a leased buffer, which comes back with the completed
+    /// \c Transfer. The buffer must not be empty, and must hold at least \c length bytes.
+    void bulkWriteAsync(uint8 endpoint, Buffer buffer, uint32 length, uint32 timeout, uint64 tag = 0) {
+      checkLease(buffer, length, "bulkWriteAsync");
+      const char *error = nullptr;
+      const USBStatus status = usbBulkWriteAsync(
+        m_dev, endpoint, buffer.data(), length, timeout, tag, &error);
+      detail::check(status, error);
+      m_inFlight.emplace(buffer.data(), std::move(buffer));
+    }
+
+    /// Read into the caller's memory, which must stay valid until the transfer completes.
+    void bulkReadAsync(uint8 endpoint, std::span<uint8> data, uint32 timeout, uint64 tag = 0) {
+      const char *error = nullptr;
+      const USBStatus status = usbBulkReadAsync(
+        m_dev, endpoint, data.data(), (uint32)data.size(), timeout, tag, &error);
+      detail::check(status, error);
+    }
+
+    /// Write from the caller's memory, which must stay valid until the transfer completes.
+    void bulkWriteAsync(uint8 endpoint, std::span<const uint8> data, uint32 timeout, uint64 tag = 0) {
+      const char *error = nullptr;
+      const USBStatus status = usbBulkWriteAsync(
+        m_dev, endpoint, data.data(), (uint32)data.size(), timeout, tag, &error);
+      detail::check(status, error);
+    }
+
+    /// Await the oldest outstanding transfer.
+    Transfer await() {
+      CompletionReport report;
+      const char *error = nullptr;
+      const USBStatus status = usbBulkAwaitCompletion(m_dev, &report, &error);
+      return complete(status, report, error);
+    }
+
+    /// Await the oldest outstanding transfer for up to \c timeout milliseconds.
+    std::optional<Transfer> await(uint32 timeout) {
+      CompletionReport report;
+      const char *error = nullptr;
+      const USBStatus status = usbBulkAwaitCompletionTimeout(m_dev, &report, timeout, &error);
+      if (status == USB_PENDING) {
+        return std::nullopt;
+      }
+      return complete(status, report, error);
+    }
+
+    size_t numOutstanding() const noexcept { return usbNumOutstandingRequests(m_dev); }
+
+  private:
+    // A leased buffer must be big enough for the transfer. It mustn't be empty either: a null
+    // buffer would ask the library to use one of its own, and couldn't be keyed in m_inFlight.
+    static void checkLease(const Buffer &buffer, uint32 length, const char *func) {
+      if (!buffer) {
+        throw Error(USB_INVALID_OPTIONS, std::string(func) + "(): The buffer is empty");
+      }
+      if (length > buffer.size()) {
+        throw Error(
+          USB_ASYNC_SIZE, std::string(func) + "(): Transfer length exceeds buffer size");
+      }
+    }
+
+    // Turn an await's result into a Transfer, reuniting it with its leased buffer. Failures of
+    // the transfer itself are reported in the Transfer; anything else is thrown.
+    Transfer complete(USBStatus status, const CompletionReport &report, const char *error) {
+      if (status != USB_TIMEOUT && status != USB_ASYNC_TRANSFER) {
+        detail::check(status, error);
+      } else if (error) {
+        usbFreeError(error);
+      }
+      Buffer buffer;
+      const auto it = m_inFlight.find(report.buffer);
+      if (it != m_inFlight.end()) {
+        buffer = std::move(it->second);
+        m_inFlight.erase(it);
+      }
+      return Transfer(status, report, std::move(buffer));
+    }
+
+    USBDevice *m_dev = nullptr;
+    int m_iface;
+    std::unordered_map<const uint8 *, Buffer> m_inFlight;  // leased buffers, by address
+  };
+}
+
+#endif
@@ -0,0 +1,372 @@
+/*
+ * Copyright (C) 2009-2012 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file libusbwrap_coro.hpp
+ *
+ * C++20 coroutine interface over the async transfer API. Each transfer is an awaitable whose
+ * completion resumes the awaiting coroutine, so a pipelined protocol can be written as
+ * straight-line code, with as many conversations in flight as there are coroutines:
+ *
+ * @code
+ * makestuff::usb::Task<void> exchange(makestuff::usb::Executor &ex, uint8 *buf) {
+ *   auto w = co_await ex.bulkWrite(0x02, {buf, 5});
+ *   auto r = co_await ex.bulkRead(0x86, {buf, 512});
+ *   ...
+ * }
+ * ...
+ * makestuff::usb::Executor ex(dev);
+ * ex.spawn(exchange(ex, buf));
+ * ex.run();
+ * @endcode
+ */
+#ifndef LIBUSBWRAP_CORO_HPP
+#define LIBUSBWRAP_CORO_HPP
+
+#include <makestuff/libusbwrap.h>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <utility>
+
+namespace makestuff::usb {
+
+  /**
+   * The outcome of an awaited transfer.
+   */
+  struct Completion {
+    USBStatus status;         ///< \c USB_SUCCESS, or why the transfer failed or wasn't submitted.
+    CompletionReport report;  ///< Only meaningful if the transfer was submitted.
+    std::string error;        ///< The library's message, if the submission itself failed.
+  };
+
+  template<typename T> class Task;
+
+  namespace detail {
+    // The state shared by a task's promise types, whatever they return.
+    struct PromiseBase {
+      std::coroutine_handle<> continuation;
+      std::exception_ptr exception;
+
+      std::suspend_always initial_suspend() noexcept { return {}; }
+
+      // Resume whoever was awaiting this task, if anyone.
+      struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template<typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+          auto next = h.promise().continuation;
+          return next ? next : std::noop_coroutine();
+        }
+        void await_resume() noexcept { }
+      };
+      FinalAwaiter final_suspend() noexcept { return {}; }
+
+      void unhandled_exception() noexcept { exception = std::current_exception(); }
+    };
+
+    template<typename T>
+    struct Promise : PromiseBase {
+      std::optional<T> value;
+      Task<T> get_return_object() noexcept;
+      void return_value(T v) { value.emplace(std::move(v)); }
+      T result() {
+        if (exception) {
+          std::rethrow_exception(exception);
+        }
+        return std::move(*value);
+      }
+    };
+
+    template<>
+    struct Promise<void> : PromiseBase {
+      Task<void> get_return_object() noexcept;
+      void return_void() noexcept { }
+      void result() {
+        if (exception) {
+          std::rethrow_exception(exception);
+        }
+      }
+    };
+  }
+
+  /**
+   * A lazily-started coroutine. Await it from another task, or hand a \c Task<void> to
+   * \c Executor::spawn() to run it at top level.
+   */
+  template<typename T = void>
+  class Task {
+  public:
+    using promise_type = detail::Promise<T>;
+
+    Task(Task &&other) noexcept : m_handle(std::exchange(other.m_handle, {})) { }
+    Task &operator=(Task &&other) noexcept {
+      if (this != &other) {
+        if (m_handle) {
+          m_handle.destroy();
+        }
+        m_handle = std::exchange(other.m_handle, {});
+      }
+      return *this;
+    }
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task() {
+      if (m_handle) {
+        m_handle.destroy();
+      }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+      m_handle.promise().continuation = awaiter;
+      return m_handle;
+    }
+    T await_resume() { return m_handle.promise().result(); }
+
+  private:
+    friend promise_type;
+    friend class Executor;
+    explicit Task(std::coroutine_handle<promise_type> h) noexcept : m_handle(h) { }
+    std::coroutine_handle<promise_type> m_handle;
+  };
+
+  namespace detail {
+    template<typename T>
+    Task<T> Promise<T>::get_return_object() noexcept {
+      return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+    }
+    inline Task<void> Promise<void>::get_return_object() noexcept {
+      return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+    }
+  }
+
+  /**
+   * Runs coroutines which await transfers on one device.
+   *
+   * The executor installs itself as the device's completion callback and starts the event
+   * thread of the device's context. Each awaitable submits its transfer with its own address as
+   * the tag; when the event thread reports the completion, the awaiting coroutine is queued,
+   * and it's resumed by \c run() on the executor's thread. So coroutines only ever run on that
+   * thread, and never on the event thread. While the executor exists, every async transfer on
+   * the device must be submitted through it.
+   */
+  class Executor {
+  public:
+    /**
+     * An async transfer, submitted when it's awaited.
+     */
+    class Transfer {
+    public:
+      bool await_ready() const noexcept { return false; }
+      bool await_suspend(std::coroutine_handle<> h) noexcept {
+        const char *error = nullptr;
+        m_handle = h;
+        const USBStatus status = m_submit(*this, &error);
+        if (status != USB_SUCCESS) {
+          m_result.status = status;  // once submitted, m_result belongs to onCompletion()
+          if (error) {
+            m_result.error = error;
+            usbFreeError(error);
+          }
+          return false;  // nothing to wait for
+        }
+        m_executor.m_numInFlight++;
+        return true;
+      }
+      Completion await_resume() { return std::move(m_result); }
+
+    private:
+      friend class Executor;
+      using Submit = USBStatus (*)(Transfer &, const char **);
+      Transfer(Executor &ex, Submit submit, uint8 ep, uint8 *data, uint32 len, uint32 timeout)
+        : m_executor(ex), m_submit(submit), m_endpoint(ep), m_data(data), m_length(len),
+          m_timeout(timeout), m_result{USB_SUCCESS, {}, {}} { }
+      uint64 tag() const noexcept { return (uint64)(uintptr_t)this; }
+
+      Executor &m_executor;
+      Submit m_submit;
+      uint8 m_endpoint;
+      uint8 *m_data;
+      uint32 m_length;
+      uint32 m_timeout;
+      std::coroutine_handle<> m_handle;
+      Completion m_result;
+    };
+
+    /**
+     * Take over the device's completion callback, and make sure the event thread is running.
+     * Failure to start it is reported by \c run().
+     */
+    explicit Executor(USBDevice *dev) : m_dev(dev) {
+      const char *error = nullptr;
+      m_startStatus = usbContextEventThreadStart(usbDeviceContext(dev), &error);
+      if (error) {
+        m_startError = error;
+        usbFreeError(error);
+      }
+      usbSetCompletionCallback(m_dev, &Executor::onCompletion, this);
+    }
+    /**
+     * Cancel and reap anything still in flight, since it would complete into the frames of the
+     * tasks destroyed here. If that fails, LibUSB may still be using their buffers, so those
+     * frames are leaked rather than freed.
+     */
+    ~Executor() {
+      const USBStatus status = usbCancelAll(m_dev, USB_ALL_ENDPOINTS, nullptr, nullptr);
+      usbSetCompletionCallback(m_dev, nullptr, nullptr);
+      if (status != USB_SUCCESS && m_numInFlight) {
+        for (Task<void> &task : m_tasks) {
+          task.m_handle = {};
+        }
+      }
+    }
+    Executor(const Executor &) = delete;
+    Executor &operator=(const Executor &) = delete;
+
+    /// Await a bulk read into the caller's buffer.
+    Transfer bulkRead(uint8 endpoint, std::span<uint8> buffer, uint32 timeout = 0) {
+      return Transfer(
+        *this, [](Transfer &t, const char **error) {
+          return usbBulkReadAsync(
+            t.m_executor.m_dev, t.m_endpoint, t.m_data, t.m_length, t.m_timeout, t.tag(),
+            error);
+        }, endpoint, buffer.data(), (uint32)buffer.size(), timeout);
+    }
+
+    /// Await a bulk write from the caller's buffer.
+    Transfer bulkWrite(uint8 endpoint, std::span<const uint8> buffer, uint32 timeout = 0) {
+      return Transfer(
+        *this, [](Transfer &t, const char **error) {
+          return usbBulkWriteAsync(
+            t.m_executor.m_dev, t.m_endpoint, t.m_data, t.m_length, t.m_timeout, t.tag(),
+            error);
+        }, endpoint, const_cast<uint8 *>(buffer.data()), (uint32)buffer.size(), timeout);
+    }
+
+    /// Await an interrupt read into the caller's buffer.
+    Transfer interruptRead(uint8 endpoint, std::span<uint8> buffer, uint32 timeout = 0) {
+      return Transfer(
+        *this, [](Transfer &t, const char **error) {
+          return usbInterruptReadAsync(
+            t.m_executor.m_dev, t.m_endpoint, t.m_data, t.m_length, t.m_timeout, t.tag(),
+            error);
+        }, endpoint, buffer.data(), (uint32)buffer.size(), timeout);
+    }
+
+    /// Await an interrupt write from the caller's buffer.
+    Transfer interruptWrite(uint8 endpoint, std::span<const uint8> buffer, uint32 timeout = 0) {
+      return Transfer(
+        *this, [](Transfer &t, const char **error) {
+          return usbInterruptWriteAsync(
+            t.m_executor.m_dev, t.m_endpoint, t.m_data, t.m_length, t.m_timeout, t.tag(),
+            error);
+        }, endpoint, const_cast<uint8 *>(buffer.data()), (uint32)buffer.size(), timeout);
+    }
+
+    /**
+     * Start a top-level task. It runs on this thread up to its first suspension; \c run() takes
+     * care of the rest. The executor owns it from here on.
+     */
+    void spawn(Task<void> task) {
+      m_tasks.push_back(std::move(task));
+      m_numActive++;
+      m_tasks.back().m_handle.promise().continuation = std::noop_coroutine();
+      m_tasks.back().m_handle.resume();
+      reap();
+    }
+
+    /**
+     * Resume coroutines as their transfers complete, until every spawned task has finished.
+     * Returns the event thread's start-up status if that failed, since nothing can complete;
+     * or \c USB_EMPTY_QUEUE if tasks remain but none of them is awaiting a transfer. Any
+     * exception escaping a task is rethrown here.
+     */
+    USBStatus run() {
+      if (m_startStatus != USB_SUCCESS) {
+        return m_startStatus;
+      }
+      while (m_numActive) {
+        std::coroutine_handle<> next;
+        if (m_numInFlight == 0) {
+          return USB_EMPTY_QUEUE;  // the remaining tasks are waiting on something else
+        }
+        {
+          std::unique_lock<std::mutex> lock(m_mutex);
+          m_wake.wait(lock, [this] { return !m_ready.empty(); });
+          next = m_ready.front();
+          m_ready.pop_front();
+        }
+        m_numInFlight--;
+        next.resume();
+        reap();
+      }
+      return USB_SUCCESS;
+    }
+
+    /// The message from starting the event thread, if it failed.
+    const std::string &startError() const noexcept { return m_startError; }
+
+  private:
+    // Called on the event thread: record the outcome, and queue the coroutine for run().
+    static void onCompletion(
+      USBDevice *, const CompletionReport *report, USBStatus status, void *userData)
+    {
+      Executor *const self = static_cast<Executor *>(userData);
+      Transfer *const transfer = reinterpret_cast<Transfer *>((uintptr_t)report->tag);
+      transfer->m_result.status = status;
+      transfer->m_result.report = *report;
+      {
+        std::lock_guard<std::mutex> lock(self->m_mutex);
+        self->m_ready.push_back(transfer->m_handle);
+      }
+      self->m_wake.notify_one();
+    }
+
+    // Destroy spawned tasks which have run to completion, rethrowing anything they threw.
+    void reap() {
+      for (auto it = m_tasks.begin(); it != m_tasks.end(); ) {
+        if (it->m_handle.done()) {
+          Task<void> finished = std::move(*it);
+          it = m_tasks.erase(it);
+          m_numActive--;
+          finished.m_handle.promise().result();
+        } else {
+          ++it;
+        }
+      }
+    }
+
+    USBDevice *m_dev;
+    USBStatus m_startStatus;
+    std::string m_startError;
+    std::deque<Task<void>> m_tasks;
+    size_t m_numActive = 0;
+    size_t m_numInFlight = 0;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::deque<std::coroutine_handle<>> m_ready;
+  };
+}
+
+#endif
@@ -23,11 +23,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <makestuff/common.h>
 #include <makestuff/liberror.h>
 #include "private.h"
 
-static struct libusb_context *m_ctx = NULL;
+// This horrible thing should boil down to a call to poll() with
+// timeout -1ms, which will be interpreted as "no timeout" on all
+// platforms.
+#define NO_TIMEOUT {UINT_MAX/1000, 1000*(UINT_MAX%1000)}
+
+static struct USBContext m_defaultContext = {.lock = MUTEX_INITIALIZER};  // see usbInitialise()
 
 // Modified from libusb_open_device_with_vid_pid in core.c of libusbx
 //
@@ -127,17 +133,29 @@ DLLEXPORT(bool) usbValidateVidPid(const char *vp) {
   return true;
 }
 
-// Initialise LibUSB with the given log level.
+// Create a LibUSB context with the given log level.
+//
+static int initLibUSB(struct libusb_context **libusb, int debugLevel) {
+  const int status = libusb_init(libusb);
+  if (status == LIBUSB_SUCCESS) {
+    #if LIBUSB_API_VERSION >= 0x01000106
+      libusb_set_option(*libusb, LIBUSB_OPTION_LOG_LEVEL, debugLevel);
+    #else
+      libusb_set_debug(*libusb, debugLevel);
+    #endif
+  }
+  return status;
+}
+
+// Initialise the default context with the given log level.
 //
 DLLEXPORT(USBStatus) usbInitialise(int debugLevel, const char **error) {
   USBStatus retVal = USB_SUCCESS;
-  int status = libusb_init(&m_ctx);
+  int status = initLibUSB(&m_defaultContext.libusb, debugLevel);
   CHECK_STATUS(status, USB_INIT, cleanup, "usbInitialise(): %s", libusb_error_name(status));
-  #if LIBUSB_API_VERSION >= 0x01000106
-    libusb_set_option(m_ctx, LIBUSB_OPTION_LOG_LEVEL, debugLevel);
-  #else
-    libusb_set_debug(m_ctx, debugLevel);
-  #endif
+  usbContextSetPollFdNotifiers(
+    &m_defaultContext, m_defaultContext.pollFdAdded, m_defaultContext.pollFdRemoved,
+    m_defaultContext.pollFdData);  // any set beforehand
 cleanup:
   return retVal;
 }
@@ -145,8 +163,37 @@ cleanup:
 // Shutdown LibUSB.
 //
 DLLEXPORT(void) usbShutdown() {
-  if (m_ctx) {
-    libusb_exit(m_ctx);
+  usbEventThreadStop();
+  if (m_defaultContext.libusb) {
+    libusb_exit(m_defaultContext.libusb);
+    m_defaultContext.libusb = NULL;
+  }
+}
+
+DLLEXPORT(USBStatus) usbContextCreate(
+  int debugLevel, struct USBContext **ctxPtr, const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  int status;
+  struct USBContext *ctx = (struct USBContext *)calloc(1, sizeof(struct USBContext));
+  *ctxPtr = NULL;
+  CHECK_STATUS(!ctx, USB_ALLOC_ERR, cleanup, "usbContextCreate(): Out of memory!");
+  status = initLibUSB(&ctx->libusb, debugLevel);
+  CHECK_STATUS(status, USB_INIT, cleanup, "usbContextCreate(): %s", libusb_error_name(status));
+  mutexInit(&ctx->lock);
+  *ctxPtr = ctx;
+  ctx = NULL;
+cleanup:
+  free((void*)ctx);
+  return retVal;
+}
+
+DLLEXPORT(void) usbContextDestroy(struct USBContext *ctx) {
+  if (ctx && ctx != &m_defaultContext) {
+    usbContextEventThreadStop(ctx);
+    libusb_exit(ctx->libusb);
+    mutexDestroy(&ctx->lock);
+    free((void*)ctx);
   }
 }
 
@@ -164,9 +211,9 @@ DLLEXPORT(USBStatus) usbIsDeviceAvailable(const char *vp, bool *isAvailable, con
   uint16 vid, pid, did;
   int status, count;
   CHECK_STATUS(
-    !m_ctx, USB_INIT, cleanup,
+    !m_defaultContext.libusb, USB_INIT, cleanup,
     "usbIsDeviceAvailable(): you forgot to call usbInitialise()!");
-  count = (int)libusb_get_device_list(m_ctx, &devList);
+  count = (int)libusb_get_device_list(m_defaultContext.libusb, &devList);
   CHECK_STATUS(
     count < 0, USB_CANNOT_OPEN_DEVICE, cleanup,
     "usbIsDeviceAvailable(): %s", libusb_error_name(count));
@@ -197,58 +244,246 @@ cleanup:
   return retVal;
 }
 
+// Logical transfers larger than this are split into several LibUSB transfers
+#define SUB_TRANSFER_SIZE 0x10000
+
+// A transfer descriptor; small, so deep queues stay cheap. Fields the completion path touches
+// come first. The library buffer, if any, is lent from the device's buffer pool.
+//
 struct TransferWrapper {
-  struct libusb_transfer *transfer;
+  struct USBDevice *dev;
+  struct libusb_transfer **transfers;  // sub-transfers making up this logical transfer:
+  size_t numUsed;                      //   the number filled in by the current submission,
+  size_t numPending;                   //   and the number of those yet to complete
   int completed;
+  bool aborted;                        // remaining sub-transfers have been cancelled
+  enum libusb_transfer_status status;  // overall status, once completed
+  uint32 completionOrder;
+  uint32 actualLength;
+  uint32 length;
+  uint32 id;
+  uint64 tag;                          // caller's, echoed in the report
+  uint32 numRetries;                   // times resubmitted after a stall
+  size_t resumeIndex;                  // first sub-transfer to resubmit after a stall
+  bool held;                           // finished, but awaiting resubmission after a stall
+  bool delivering;                     // in the hands of the completion callback
   struct AsyncTransferFlags flags;
-  uint8 buffer[0x10000];  // can use this...
-  uint8 *bufPtr;          // ...or this.
+  size_t numTransfers;                 // sub-transfers allocated
+  struct IsoPacketReport *packets;     // results of an isochronous transfer's packets:
+  uint32 numPackets;                   //   the number in the current submission, if any,
+  uint32 packetCapacity;               //   and the number the first sub-transfer can hold
+  uint8 *control;                      // setup packet & data stage of a control transfer,
+  uint32 controlCapacity;              //   kept for reuse
+  uint8 *controlDest;                  // where a control read's data is copied, if anywhere
+  uint32 streamId;                     // bulk stream, or zero
+  uint8 *buffer;                       // can use this (lent while in use)...
+  uint8 *bufPtr;                       // ...or this.
+  bool bufferIsDevMem;
 };
+
+static void destroyTransfer(struct TransferWrapper *tx) {
+  if (tx) {
+    size_t i;
+    for (i = 0; i < tx->numTransfers; i++) {
+      libusb_free_transfer(tx->transfers[i]);
+    }
+    free((void*)tx->transfers);
+    free((void*)tx->packets);
+    free((void*)tx->control);
+    free((void*)tx);
+  }
+}
+
+// Make sure the wrapper has at least count sub-transfers allocated.
+//
+static USBStatus allocSubTransfers(struct TransferWrapper *wrapper, size_t count) {
+  USBStatus retVal = USB_SUCCESS;
+  struct libusb_transfer **newArray;
+  if (count > wrapper->numTransfers) {
+    newArray = (struct libusb_transfer **)realloc(
+      (void*)wrapper->transfers, count * sizeof(struct libusb_transfer *));
+    CHECK_STATUS(newArray == NULL, USB_ALLOC_ERR, cleanup);
+    wrapper->transfers = newArray;
+    while (wrapper->numTransfers < count) {
+      newArray[wrapper->numTransfers] = libusb_alloc_transfer(0);
+      CHECK_STATUS(newArray[wrapper->numTransfers] == NULL, USB_ALLOC_ERR, cleanup);
+      wrapper->numTransfers++;
+    }
+  }
+cleanup:
+  return retVal;
+}
+
 struct TransferWrapper *createTransfer(void) {
   struct TransferWrapper *retVal = (struct TransferWrapper *)calloc(1, sizeof(struct TransferWrapper));
-  CHECK_STATUS(retVal == NULL, NULL, exit);
-  retVal->transfer = libusb_alloc_transfer(0);
-  CHECK_STATUS(retVal->transfer == NULL, NULL, freeWrap);
+  if (retVal && allocSubTransfers(retVal, 1) != USB_SUCCESS) {
+    destroyTransfer(retVal);
+    retVal = NULL;
+  }
   return retVal;
-freeWrap:
-  free((void*)retVal);
-exit:
-  return NULL;
 }
 
-static void destroyTransfer(struct TransferWrapper *tx) {
-  if (tx) {
-    libusb_free_transfer(tx->transfer);
-    free((void*)tx);
+// Allocate a library buffer, preferring memory the kernel can DMA into directly (on Linux, a
+// usbfs mapping), which saves copying every transfer between kernel and user space.
+//
+static uint8 *allocLibraryBuffer(struct USBDevice *dev, uint32 size, bool *isDevMem) {
+  #if LIBUSB_API_VERSION >= 0x01000105
+    if (!dev->noDevMem) {
+      uint8 *const data = libusb_dev_mem_alloc(dev->handle, size);
+      if (data) {
+        *isDevMem = true;
+        return data;
+      }
+      dev->noDevMem = true;  // unsupported or exhausted; don't keep asking
+    }
+  #endif
+  *isDevMem = false;
+  return (uint8 *)malloc(size);
+}
+
+static void freeLibraryBuffer(struct USBDevice *dev, uint8 *data, uint32 size, bool isDevMem) {
+  #if LIBUSB_API_VERSION >= 0x01000105
+    if (isDevMem) {
+      libusb_dev_mem_free(dev->handle, data, size);
+      return;
+    }
+  #else
+    (void)dev;
+    (void)size;
+    (void)isDevMem;
+  #endif
+  free((void*)data);
+}
+
+// Take a library buffer from the device's pool, allocating a new one only if none are free.
+// Called with the device lock held.
+//
+static USBStatus takePooledBuffer(
+  struct USBDevice *dev, struct LibraryBuffer *buffer, const char *func, const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  CHECK_STATUS(
+    dev->options.bufferSize == 0, USB_ASYNC_SIZE, cleanup,
+    "%s(): This device was opened without library buffers", func);
+  if (dev->numFreeBuffers) {
+    *buffer = dev->freeBuffers[--dev->numFreeBuffers];
+  } else {
+    buffer->data = allocLibraryBuffer(dev, dev->options.bufferSize, &buffer->isDevMem);
+    CHECK_STATUS(!buffer->data, USB_ALLOC_ERR, cleanup, "%s(): Out of memory!", func);
   }
+cleanup:
+  return retVal;
 }
 
-// Find the descriptor of the first occurance of the specified device
+// Add a library buffer to a growable array of them. Returns false if the array can't grow.
+//
+static bool appendLibraryBuffer(
+  struct LibraryBuffer **array, size_t *count, size_t *capacity, uint8 *data, bool isDevMem)
+{
+  if (*count == *capacity) {
+    const size_t newCapacity = *capacity ? 2 * *capacity : 4;
+    struct LibraryBuffer *const newArray = (struct LibraryBuffer *)realloc(
+      (void*)*array, newCapacity * sizeof(struct LibraryBuffer));
+    if (!newArray) {
+      return false;
+    }
+    *array = newArray;
+    *capacity = newCapacity;
+  }
+  (*array)[*count].data = data;
+  (*array)[*count].isDevMem = isDevMem;
+  (*count)++;
+  return true;
+}
+
+// Give a library buffer back to the device's pool. If the pool can't grow to take it, just free
+// it. Called with the device lock held.
+//
+static void poolBuffer(struct USBDevice *dev, uint8 *data, bool isDevMem) {
+  if (
+    !appendLibraryBuffer(
+      &dev->freeBuffers, &dev->numFreeBuffers, &dev->freeBuffersCapacity, data, isDevMem))
+  {
+    freeLibraryBuffer(dev, data, dev->options.bufferSize, isDevMem);
+  }
+}
+
+// Lend a transfer a library buffer from the device's pool. Called with the device lock held.
+//
+static USBStatus getTransferBuffer(
+  struct USBDevice *dev, struct TransferWrapper *wrapper, const char *func, const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  struct LibraryBuffer pooled;
+  if (!wrapper->buffer) {
+    retVal = takePooledBuffer(dev, &pooled, func, error);
+    CHECK_STATUS(retVal, retVal, cleanup);
+    wrapper->buffer = pooled.data;
+    wrapper->bufferIsDevMem = pooled.isDevMem;
+  }
+cleanup:
+  return retVal;
+}
+
+// Return a transfer's library buffer, if it has one, to the device's pool. Called with the
+// device lock held.
 //
+static void releaseTransferBuffer(struct USBDevice *dev, struct TransferWrapper *wrapper) {
+  if (wrapper->buffer) {
+    poolBuffer(dev, wrapper->buffer, wrapper->bufferIsDevMem);
+    wrapper->buffer = NULL;
+  }
+}
+
 DLLEXPORT(USBStatus) usbOpenDevice(
   const char *vp, int configuration, int iface, int altSetting,
   struct USBDevice **devHandlePtr, const char **error)
+{
+  return usbOpenDeviceWithOptions(
+    vp, configuration, iface, altSetting, NULL, devHandlePtr, error);
+}
+
+DLLEXPORT(USBStatus) usbOpenDeviceWithOptions(
+  const char *vp, int configuration, int iface, int altSetting,
+  const struct USBOpenOptions *options, struct USBDevice **devHandlePtr, const char **error)
+{
+  return usbOpenDeviceInContext(
+    NULL, vp, configuration, iface, altSetting, options, devHandlePtr, error);
+}
+
+DLLEXPORT(USBStatus) usbOpenDeviceInContext(
+  struct USBContext *ctx, const char *vp, int configuration, int iface, int altSetting,
+  const struct USBOpenOptions *options, struct USBDevice **devHandlePtr, const char **error)
 {
   USBStatus retVal = USB_SUCCESS;
+  const struct USBOpenOptions defaultOptions = USB_DEFAULT_OPEN_OPTIONS;
   uint16 vid, pid, did;
   int status;
   struct USBDevice *newWrapper;
   struct libusb_device_handle *newHandle;
+  if (!ctx) {
+    ctx = &m_defaultContext;
+  }
   CHECK_STATUS(
-    !m_ctx, USB_INIT, exit,
+    !ctx->libusb, USB_INIT, exit,
     "usbOpenDevice(): you forgot to call usbInitialise()!");
+  if (!options) {
+    options = &defaultOptions;
+  }
+  CHECK_STATUS(
+    options->initialDepth == 0 || (options->maxDepth && options->initialDepth > options->maxDepth),
+    USB_INVALID_OPTIONS, exit,
+    "usbOpenDevice(): Initial depth must be nonzero, and no more than the maximum depth");
   CHECK_STATUS(
     !usbValidateVidPid(vp), USB_INVALID_VIDPID, exit,
     "usbOpenDevice(): "FORMAT_ERR, vp);
   vid = (uint16)strtoul(vp, NULL, 16);
   pid = (uint16)strtoul(vp+5, NULL, 16);
   did = (uint16)((strlen(vp) == 14) ? strtoul(vp+10, NULL, 16) : 0x0000);
-  newWrapper = (struct USBDevice *)malloc(sizeof(struct USBDevice));
+  newWrapper = (struct USBDevice *)calloc(1, sizeof(struct USBDevice));
   CHECK_STATUS(newWrapper == NULL, USB_ALLOC_ERR, exit, "usbOpenDevice(): Out of memory!");
-  status = queueInit(&newWrapper->queue, 4, (CreateFunc)createTransfer, (DestroyFunc)destroyTransfer);
-  CHECK_STATUS(status, USB_ALLOC_ERR, freeWrap, "usbOpenDevice(): Out of memory!");
-  newHandle = libusbOpenWithVidPid(m_ctx, vid, pid, did, error);
-  CHECK_STATUS(!newHandle, USB_CANNOT_OPEN_DEVICE, freeQueue, "usbOpenDevice()");
+  newHandle = libusbOpenWithVidPid(ctx->libusb, vid, pid, did, error);
+  CHECK_STATUS(!newHandle, USB_CANNOT_OPEN_DEVICE, freeWrap, "usbOpenDevice()");
   status = libusb_set_configuration(newHandle, configuration);
   CHECK_STATUS(
     status < 0, USB_CANNOT_SET_CONFIGURATION, closeDev,
@@ -262,14 +497,16 @@ DLLEXPORT(USBStatus) usbOpenDevice(
     status < 0, USB_CANNOT_SET_ALTINT, release,
     "usbOpenDevice(): %s", libusb_error_name(status));
   newWrapper->handle = newHandle;
+  newWrapper->ctx = ctx;
+  newWrapper->options = *options;
+  mutexInit(&newWrapper->lock);
+  condInit(&newWrapper->completion);
   *devHandlePtr = newWrapper;
   return USB_SUCCESS;
 release:
   libusb_release_interface(newHandle, iface);
 closeDev:
   libusb_close(newHandle);
-freeQueue:
-  queueDestroy(&newWrapper->queue);
 freeWrap:
   free((void*)newWrapper);
 exit:
@@ -277,12 +514,62 @@ exit:
   return retVal;
 }
 
+DLLEXPORT(struct USBContext *) usbDeviceContext(struct USBDevice *dev) {
+  return dev->ctx;
+}
+
+static size_t countIncomplete(struct USBDevice *dev, uint8 endpoint);
+
 DLLEXPORT(void) usbCloseDevice(struct USBDevice *dev, int iface) {
   if (dev) {
     struct libusb_device_handle *ptr = dev->handle;
+    struct TransferWrapper *wrapper;
+    size_t i, j;
+
+    // LibUSB must be done with every transfer before any of them are freed. If event handling
+    // fails while some are still in flight, leak the device rather than free them under LibUSB.
+    if (usbCancelAll(dev, USB_ALL_ENDPOINTS, NULL, NULL) != USB_SUCCESS) {
+      bool stranded;
+      mutexLock(&dev->lock);
+      stranded = countIncomplete(dev, USB_ALL_ENDPOINTS) != 0;
+      mutexUnlock(&dev->lock);
+      if (stranded) {
+        return;
+      }
+    }
+
+    // Device memory must be freed while the handle is still open
+    for (i = 0; i < NUM_QUEUES; i++) {
+      for (j = 0; dev->queues[i].itemArray && j < dev->queues[i].capacity; j++) {
+        wrapper = (struct TransferWrapper *)dev->queues[i].itemArray[j];
+        if (wrapper->buffer) {
+          freeLibraryBuffer(dev, wrapper->buffer, dev->options.bufferSize, wrapper->bufferIsDevMem);
+        }
+      }
+    }
+    if (dev->spare && dev->spare->buffer) {
+      freeLibraryBuffer(
+        dev, dev->spare->buffer, dev->options.bufferSize, dev->spare->bufferIsDevMem);
+    }
+    for (i = 0; i < dev->numFreeBuffers; i++) {
+      freeLibraryBuffer(
+        dev, dev->freeBuffers[i].data, dev->options.bufferSize, dev->freeBuffers[i].isDevMem);
+    }
+    free((void*)dev->freeBuffers);
+    for (i = 0; i < dev->numLeased; i++) {
+      freeLibraryBuffer(
+        dev, dev->leased[i].data, dev->options.bufferSize, dev->leased[i].isDevMem);
+    }
+    free((void*)dev->leased);
+
     libusb_release_interface(ptr, iface);
     libusb_close(ptr);
-    queueDestroy(&dev->queue);
+    for (i = 0; i < NUM_QUEUES; i++) {
+      queueDestroy(&dev->queues[i]);
+    }
+    destroyTransfer(dev->spare);
+    condDestroy(&dev->completion);
+    mutexDestroy(&dev->lock);
     free((void*)dev);
   }
 }
@@ -401,179 +688,456 @@ cleanup:
   return retVal;
 }
 
-static void LIBUSB_CALL bulk_transfer_cb(struct libusb_transfer *transfer) {
-  int *completed = transfer->user_data;
-  *completed = 1;
+DLLEXPORT(USBStatus) usbInterruptRead(
+  struct USBDevice *dev, uint8 endpoint, uint8 *data, uint32 count, uint32 *numRead,
+  uint32 timeout, const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  int numReceived = 0;
+  int status = libusb_interrupt_transfer(
+    dev->handle,
+    LIBUSB_ENDPOINT_IN | endpoint,
+    data,
+    (int)count,
+    &numReceived,
+    timeout
+  );
+  *numRead = (uint32)numReceived;
+  CHECK_STATUS(
+    status == LIBUSB_ERROR_TIMEOUT, USB_TIMEOUT, cleanup,
+    "usbInterruptRead(): Timeout");
+  CHECK_STATUS(
+    status < 0, USB_INTERRUPT, cleanup,
+    "usbInterruptRead(): %s", libusb_error_name(status));
+cleanup:
+  return retVal;
 }
 
-DLLEXPORT(USBStatus) usbBulkWriteAsync(
-  struct USBDevice *dev, uint8 endpoint, const uint8 *buffer, uint32 length, uint32 timeout,
-  const char **error)
+DLLEXPORT(USBStatus) usbInterruptWrite(
+  struct USBDevice *dev, uint8 endpoint, const uint8 *data, uint32 count,
+  uint32 timeout, const char **error)
 {
-  int retVal = USB_SUCCESS;
-  struct TransferWrapper *wrapper;
-  struct libusb_transfer *transfer;
-  int *completed;
-  int iStatus;
-  USBStatus uStatus = queuePut(&dev->queue, (Item*)&wrapper);
-  CHECK_STATUS(uStatus, uStatus, cleanup);
-  transfer = wrapper->transfer;
-  completed = &wrapper->completed;
-  *completed = 0;
-  wrapper->flags.isRead = 0;
-  libusb_fill_bulk_transfer(
-    transfer, dev->handle, LIBUSB_ENDPOINT_OUT | endpoint, (uint8 *)buffer, (int)length,
-    bulk_transfer_cb, completed, timeout
+  USBStatus retVal = USB_SUCCESS;
+  int numWritten;
+  int status = libusb_interrupt_transfer(
+    dev->handle,
+    LIBUSB_ENDPOINT_OUT | endpoint,
+    (uint8 *)data,
+    (int)count,
+    &numWritten,
+    timeout
   );
-  transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
-  iStatus = libusb_submit_transfer(transfer);
   CHECK_STATUS(
-    iStatus, USB_ASYNC_SUBMIT, cleanup,
-    "usbBulkWriteAsync(): Submission error: %s", libusb_error_name(iStatus)
-  );
-  queueCommitPut(&dev->queue);
+    status == LIBUSB_ERROR_TIMEOUT, USB_TIMEOUT, cleanup,
+    "usbInterruptWrite(): Timeout");
+  CHECK_STATUS(
+    status < 0, USB_INTERRUPT, cleanup,
+    "usbInterruptWrite(): %s", libusb_error_name(status));
+  CHECK_STATUS(
+    (uint32)numWritten != count, USB_INTERRUPT, cleanup,
+    "usbInterruptWrite(): Expected to write %d bytes but actually wrote %d", count, numWritten);
 cleanup:
   return retVal;
 }
 
-DLLEXPORT(USBStatus) usbBulkWriteAsyncPrepare(
-  struct USBDevice *dev, uint8 **buffer, const char **error)
+// Get the in-flight queue for an endpoint address, creating it on first use. Called with the
+// device lock held.
+//
+static USBStatus getQueue(
+  struct USBDevice *dev, uint8 endpoint, struct UnboundedQueue **queue, const char *func,
+  const char **error)
 {
   USBStatus retVal = USB_SUCCESS;
-  struct TransferWrapper *wrapper;
-  USBStatus status = queuePut(&dev->queue, (Item*)&wrapper);
-  CHECK_STATUS(status, status, cleanup, "usbBulkWriteAsyncPrepare(): Work queue insertion error");
-  *buffer = wrapper->buffer;
+  struct UnboundedQueue *const thisQueue = &dev->queues[QUEUE_INDEX(endpoint)];
+  if (!thisQueue->itemArray) {
+    USBStatus status = queueInit(
+      thisQueue, dev->options.initialDepth,
+      (CreateFunc)createTransfer, (DestroyFunc)destroyTransfer);
+    CHECK_STATUS(status, status, cleanup, "%s(): Work queue allocation error", func);
+  }
+  *queue = thisQueue;
 cleanup:
   return retVal;
 }
 
-DLLEXPORT(USBStatus) usbBulkWriteAsyncSubmit(
-  struct USBDevice *dev, uint8 endpoint, uint32 length, uint32 timeout, const char **error)
+// Clear what's left of a transfer's previous use.
+//
+static void resetTransfer(struct USBDevice *dev, struct TransferWrapper *wrapper) {
+  wrapper->dev = dev;
+  wrapper->completed = 0;
+  wrapper->flags.isPoll = 0;
+  wrapper->flags.pollStopped = 0;
+  wrapper->numPackets = 0;
+  wrapper->controlDest = NULL;
+  wrapper->streamId = 0;
+  wrapper->numRetries = 0;
+  wrapper->held = false;
+  wrapper->delivering = false;
+}
+
+// Reserve the next transfer on an endpoint's queue, for a poll read or anything else. The slot's
+// previous occupant may have kept its library buffer, for its report; that goes back to the pool
+// now, and is the first taken out again if the new transfer needs one. Called with the device
+// lock held.
+//
+static USBStatus reserveSlot(
+  struct USBDevice *dev, uint8 endpoint, struct UnboundedQueue **queue,
+  struct TransferWrapper **wrapper, const char *func, const char **error)
+{
+  USBStatus retVal = getQueue(dev, endpoint, queue, func, error);
+  CHECK_STATUS(retVal, retVal, cleanup);
+  CHECK_STATUS(
+    dev->options.maxDepth && queueSize(*queue) >= dev->options.maxDepth, USB_QUEUE_FULL, cleanup,
+    "%s(): Endpoint 0x%02X already has %d transfers in flight",
+    func, endpoint, (int)dev->options.maxDepth);
+  retVal = queuePut(*queue, (Item*)wrapper);
+  CHECK_STATUS(retVal, retVal, cleanup, "%s(): Work queue insertion error", func);
+  releaseTransferBuffer(dev, *wrapper);
+  resetTransfer(dev, *wrapper);
+cleanup:
+  return retVal;
+}
+
+// Reserve the next transfer on an endpoint's queue, other than for a poll read. A polled endpoint
+// always has a read armed at the head of its queue, which may never complete, so nothing else
+// may queue behind it. Called with the device lock held.
+//
+static USBStatus reserveTransfer(
+  struct USBDevice *dev, uint8 endpoint, struct UnboundedQueue **queue,
+  struct TransferWrapper **wrapper, const char *func, const char **error)
 {
   USBStatus retVal = USB_SUCCESS;
-  struct TransferWrapper *wrapper;
-  struct libusb_transfer *transfer;
-  int *completed;
-  USBStatus uStatus;
-  int iStatus;
   CHECK_STATUS(
-    length > 0x10000, USB_ASYNC_SIZE, cleanup,
-    "usbBulkWriteAsyncSubmit(): Transfer length exceeds 0x10000");
-  uStatus = queuePut(&dev->queue, (Item*)&wrapper);
-  CHECK_STATUS(uStatus, uStatus, cleanup, "usbBulkWriteAsyncSubmit(): Work queue insertion error");
-  transfer = wrapper->transfer;
-  completed = &wrapper->completed;
-  *completed = 0;
-  wrapper->flags.isRead = 0;
-  libusb_fill_bulk_transfer(
-    transfer, dev->handle, LIBUSB_ENDPOINT_OUT | endpoint, wrapper->buffer, (int)length,
-    bulk_transfer_cb, completed, timeout
+    (endpoint & LIBUSB_ENDPOINT_IN) && dev->polls[endpoint & 0x0F].active, USB_POLLED, cleanup,
+    "%s(): Endpoint 0x%02X is being polled", func, endpoint);
+  retVal = reserveSlot(dev, endpoint, queue, wrapper, func, error);
+cleanup:
+  return retVal;
+}
+
+static void LIBUSB_CALL bulk_transfer_cb(struct libusb_transfer *transfer);
+
+// Append as many sub-transfers as it takes to cover one contiguous piece of a logical
+// transfer. Called with the device lock held.
+//
+static USBStatus appendSubTransfers(
+  struct TransferWrapper *wrapper, uint8 endpoint, uint8 *buffer, uint32 length,
+  uint32 timeout, const char *func, const char **error)
+{
+  USBStatus retVal;
+  const size_t count = length ? (length + SUB_TRANSFER_SIZE - 1) / SUB_TRANSFER_SIZE : 1;
+  uint32 chunkLength;
+  size_t i;
+  retVal = allocSubTransfers(wrapper, wrapper->numUsed + count);
+  CHECK_STATUS(retVal, retVal, cleanup, "%s(): Out of memory!", func);
+  wrapper->length += length;
+  for (i = 0; i < count; i++) {
+    chunkLength = (length > SUB_TRANSFER_SIZE) ? SUB_TRANSFER_SIZE : length;
+    libusb_fill_bulk_transfer(
+      wrapper->transfers[wrapper->numUsed++], wrapper->dev->handle, endpoint, buffer,
+      (int)chunkLength, bulk_transfer_cb, wrapper, timeout
+    );
+    buffer += chunkLength;
+    length -= chunkLength;
+  }
+cleanup:
+  return retVal;
+}
+
+// Fill in as many sub-transfers as it takes to cover a logical transfer of the given length.
+// Called with the device lock held.
+//
+static USBStatus fillBulkTransfer(
+  struct TransferWrapper *wrapper, uint8 endpoint, uint8 *buffer, uint32 length,
+  uint32 timeout, const char *func, const char **error)
+{
+  wrapper->numUsed = 0;
+  wrapper->length = 0;
+  return appendSubTransfers(wrapper, endpoint, buffer, length, timeout, func, error);
+}
+
+// Make a filled transfer's sub-transfers interrupt transfers rather than bulk.
+//
+static void makeInterruptTransfer(struct TransferWrapper *wrapper) {
+  size_t i;
+  for (i = 0; i < wrapper->numUsed; i++) {
+    wrapper->transfers[i]->type = LIBUSB_TRANSFER_TYPE_INTERRUPT;
+  }
+}
+
+#if LIBUSB_API_VERSION >= 0x01000103
+  // Make a filled transfer's sub-transfers bulk stream transfers on the given stream. They all
+  // go on the same stream, so the device sees them in order.
+  //
+  static void makeStreamTransfer(struct TransferWrapper *wrapper, uint32 streamId) {
+    size_t i;
+    wrapper->streamId = streamId;
+    for (i = 0; i < wrapper->numUsed; i++) {
+      wrapper->transfers[i]->type = LIBUSB_TRANSFER_TYPE_BULK_STREAM;
+      libusb_transfer_set_stream_id(wrapper->transfers[i], streamId);
+    }
+  }
+#endif
+
+// Fill in a single isochronous transfer of numPackets packets, each packetSize bytes long,
+// reallocating the first sub-transfer if it can't hold that many packets. Called with the
+// device lock held.
+//
+static USBStatus fillIsoTransfer(
+  struct TransferWrapper *wrapper, uint8 endpoint, uint8 *buffer, uint32 numPackets,
+  uint32 packetSize, uint32 timeout, const char *func, const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  struct libusb_transfer *newTransfer;
+  struct IsoPacketReport *newPackets;
+  if (wrapper->packetCapacity < numPackets) {
+    newPackets = (struct IsoPacketReport *)realloc(
+      (void*)wrapper->packets, numPackets * sizeof(struct IsoPacketReport));
+    CHECK_STATUS(!newPackets, USB_ALLOC_ERR, cleanup, "%s(): Out of memory!", func);
+    wrapper->packets = newPackets;
+    newTransfer = libusb_alloc_transfer((int)numPackets);
+    CHECK_STATUS(!newTransfer, USB_ALLOC_ERR, cleanup, "%s(): Out of memory!", func);
+    libusb_free_transfer(wrapper->transfers[0]);
+    wrapper->transfers[0] = newTransfer;
+    wrapper->packetCapacity = numPackets;
+  }
+  libusb_fill_iso_transfer(
+    wrapper->transfers[0], wrapper->dev->handle, endpoint, buffer, (int)(numPackets * packetSize),
+    (int)numPackets, bulk_transfer_cb, wrapper, timeout
   );
-  transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
-  iStatus = libusb_submit_transfer(transfer);
-  CHECK_STATUS(
-    iStatus, USB_ASYNC_SUBMIT, cleanup,
-    "usbBulkWriteAsyncSubmit(): Submission error: %s", libusb_error_name(iStatus));
-  queueCommitPut(&dev->queue);
+  libusb_set_iso_packet_lengths(wrapper->transfers[0], packetSize);
+  wrapper->numUsed = 1;
+  wrapper->length = numPackets * packetSize;
+  wrapper->numPackets = numPackets;
 cleanup:
   return retVal;
 }
 
-DLLEXPORT(USBStatus) usbBulkReadAsync(
-  struct USBDevice *dev, uint8 endpoint, uint8 *buffer, uint32 length, uint32 timeout, const char **error)
+// Fill in a single vendor control transfer, growing the wrapper's own buffer if it can't hold
+// the setup packet and data stage. Called with the device lock held.
+//
+static USBStatus fillControlTransfer(
+  struct TransferWrapper *wrapper, uint8 bmRequestType, uint8 bRequest, uint16 wValue,
+  uint16 wIndex, uint16 wLength, uint32 timeout, const char *func, const char **error)
 {
   USBStatus retVal = USB_SUCCESS;
-  struct TransferWrapper *wrapper;
-  struct libusb_transfer *transfer;
-  int *completed;
-  USBStatus uStatus;
-  int iStatus;
-  CHECK_STATUS(
-    length > 0x10000, USB_ASYNC_SIZE, cleanup,
-    "usbBulkReadAsync(): Transfer length exceeds 0x10000");
-  uStatus = queuePut(&dev->queue, (Item*)&wrapper);
-  CHECK_STATUS(uStatus, uStatus, cleanup, "usbBulkReadAsync(): Work queue insertion error");
-  transfer = wrapper->transfer;
-  completed = &wrapper->completed;
-  *completed = 0;
-  wrapper->flags.isRead = 1;
-  if (buffer) {
-    wrapper->bufPtr = buffer;
-  } else {
-    buffer = wrapper->buffer;
+  const uint32 size = LIBUSB_CONTROL_SETUP_SIZE + wLength;
+  uint8 *newControl;
+  if (wrapper->controlCapacity < size) {
+    newControl = (uint8 *)realloc((void*)wrapper->control, size);
+    CHECK_STATUS(!newControl, USB_ALLOC_ERR, cleanup, "%s(): Out of memory!", func);
+    wrapper->control = newControl;
+    wrapper->controlCapacity = size;
   }
-  libusb_fill_bulk_transfer(
-    transfer, dev->handle, LIBUSB_ENDPOINT_IN | endpoint, buffer, (int)length,
-    bulk_transfer_cb, completed, timeout
+  retVal = allocSubTransfers(wrapper, 1);
+  CHECK_STATUS(retVal, retVal, cleanup, "%s(): Out of memory!", func);
+  libusb_fill_control_setup(wrapper->control, bmRequestType, bRequest, wValue, wIndex, wLength);
+  libusb_fill_control_transfer(
+    wrapper->transfers[0], wrapper->dev->handle, wrapper->control, bulk_transfer_cb, wrapper,
+    timeout
   );
-  transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
-  iStatus = libusb_submit_transfer(transfer);
-  CHECK_STATUS(
-    iStatus, USB_ASYNC_SUBMIT, cleanup,
-    "usbBulkReadAsync(): Submission error: %s", libusb_error_name(iStatus));
-  queueCommitPut(&dev->queue);
+  wrapper->numUsed = 1;
+  wrapper->length = wLength;
 cleanup:
   return retVal;
 }
 
-DLLEXPORT(USBStatus) usbBulkAwaitCompletion(
-  struct USBDevice *dev, struct CompletionReport *report, const char **error)
+// Get an endpoint's max packet size, which is cached on first use. Called with the device lock
+// held.
+//
+static USBStatus getMaxPacketSize(
+  struct USBDevice *dev, uint8 endpoint, uint16 *maxPacketSize, const char *func,
+  const char **error)
 {
   USBStatus retVal = USB_SUCCESS;
-  struct TransferWrapper *wrapper;
-  struct libusb_transfer *transfer;
-  int *completed;
-  int iStatus;
-  struct timeval timeout = {UINT_MAX/1000, 1000*(UINT_MAX%1000)};
-  // This horrible thing should boil down to a call to poll() with
-  // timeout -1ms, which will be interpreted as "no timeout" on all
-  // platforms.
-  USBStatus uStatus = queueTake(&dev->queue, (Item*)&wrapper);
-  CHECK_STATUS(uStatus, uStatus, exit, "usbBulkAwaitCompletion(): Work queue fetch error");
-  transfer = wrapper->transfer;
-  completed = &wrapper->completed;
-  wrapper->bufPtr = NULL;
-  while (*completed == 0) {
-    iStatus = libusb_handle_events_timeout_completed(m_ctx, &timeout, completed);
-    if (iStatus < 0) {
-      if (iStatus == LIBUSB_ERROR_INTERRUPTED) {
-        continue;
-      }
-      if (libusb_cancel_transfer(transfer) == LIBUSB_SUCCESS) {
-        while (*completed == 0) {
-          if (libusb_handle_events_timeout_completed(m_ctx, &timeout, completed) < 0) {
-            break;
-          }
+  uint16 *const cached = &dev->maxPacketSize[QUEUE_INDEX(endpoint)];
+  if (!*cached) {
+    const int size = libusb_get_max_packet_size(libusb_get_device(dev->handle), endpoint);
+    CHECK_STATUS(
+      size <= 0, USB_CANNOT_GET_DESCRIPTOR, cleanup,
+      "%s(): Cannot get max packet size of endpoint 0x%02X: %s",
+      func, endpoint, libusb_error_name(size));
+    *cached = (uint16)size;
+  }
+  *maxPacketSize = *cached;
+cleanup:
+  return retVal;
+}
+
+// Segments shorter than this are copied rather than given sub-transfers of their own
+#define GATHER_COPY_LIMIT 0x1000
+
+// Fill in the sub-transfers of a write gathered from several segments. Splitting a write into
+// separate transfers only leaves the data stream unchanged if each one but the last is a whole
+// number of packets, so large segments are sent in place from a packet boundary, and small
+// segments (plus whatever it takes to pad out to a boundary) are copied into runs in the
+// transfer's library buffer. Called with the device lock held.
+//
+static USBStatus fillGatherTransfer(
+  struct USBDevice *dev, struct TransferWrapper *wrapper, uint8 endpoint,
+  const struct BulkSegment *segments, size_t count, uint32 timeout, const char *func,
+  const char **error)
+{
+  USBStatus retVal;
+  uint16 maxPacketSize;
+  uint32 runStart = 0, fill = 0;  // the run being copied into the library buffer
+  uint32 runLength, length, chunkLength;
+  const uint8 *data;
+  size_t i;
+  retVal = getMaxPacketSize(dev, endpoint, &maxPacketSize, func, error);
+  CHECK_STATUS(retVal, retVal, cleanup);
+  wrapper->numUsed = 0;
+  wrapper->length = 0;
+  for (i = 0; i < count; i++) {
+    data = segments[i].data;
+    length = segments[i].length;
+    while (length) {
+      runLength = fill - runStart;
+      if (runLength % maxPacketSize == 0 && length >= GATHER_COPY_LIMIT && length >= maxPacketSize) {
+        // The run ends on a packet boundary, so send this segment in place
+        if (runLength) {
+          retVal = appendSubTransfers(
+            wrapper, endpoint, wrapper->buffer + runStart, runLength, timeout, func, error);
+          CHECK_STATUS(retVal, retVal, cleanup);
+          runStart = fill;
         }
+        chunkLength = (i == count - 1) ? length : length - length % maxPacketSize;
+        retVal = appendSubTransfers(
+          wrapper, endpoint, (uint8 *)data, chunkLength, timeout, func, error);
+        CHECK_STATUS(retVal, retVal, cleanup);
+      } else {
+        // Copy, either to pad the run out to a packet boundary, or because the segment is small
+        chunkLength = length;
+        if (runLength % maxPacketSize && chunkLength > maxPacketSize - runLength % maxPacketSize) {
+          chunkLength = maxPacketSize - runLength % maxPacketSize;
+        }
+        retVal = getTransferBuffer(dev, wrapper, func, error);
+        CHECK_STATUS(retVal, retVal, cleanup);
+        CHECK_STATUS(
+          chunkLength > dev->options.bufferSize - fill, USB_ASYNC_SIZE, cleanup,
+          "%s(): Small segments exceed buffer size (0x%X)", func, dev->options.bufferSize);
+        memcpy(wrapper->buffer + fill, data, chunkLength);
+        fill += chunkLength;
       }
-      FAIL_RET(
-        USB_ASYNC_EVENT, commit,
-        "usbBulkAwaitCompletion(): Event error: %s", libusb_error_name(iStatus));
+      data += chunkLength;
+      length -= chunkLength;
     }
   }
+  if (fill > runStart || wrapper->numUsed == 0) {
+    retVal = appendSubTransfers(
+      wrapper, endpoint, (fill > runStart) ? wrapper->buffer + runStart : NULL, fill - runStart,
+      timeout, func, error);
+  }
+cleanup:
+  return retVal;
+}
 
-  report->buffer = transfer->buffer;
-  report->requestLength = (uint32)transfer->length;
-  report->actualLength = (uint32)transfer->actual_length;
-  report->flags = wrapper->flags;
+// Cancel all of a transfer's sub-transfers. Returns true if any of them were still in flight.
+//
+static bool cancelSubTransfers(struct TransferWrapper *wrapper) {
+  bool retVal = false;
+  size_t i;
+  for (i = 0; i < wrapper->numUsed; i++) {
+    if (libusb_cancel_transfer(wrapper->transfers[i]) == LIBUSB_SUCCESS) {
+      retVal = true;
+    }
+  }
+  return retVal;
+}
 
-  switch (transfer->status) {
-  case LIBUSB_TRANSFER_COMPLETED:
-    iStatus = 0;
-    break;
-  case LIBUSB_TRANSFER_TIMED_OUT:
-    iStatus = LIBUSB_ERROR_TIMEOUT;
-    break;
-  case LIBUSB_TRANSFER_STALL:
-    iStatus = LIBUSB_ERROR_PIPE;
-    break;
-  case LIBUSB_TRANSFER_OVERFLOW:
-    iStatus = LIBUSB_ERROR_OVERFLOW;
-    break;
-  case LIBUSB_TRANSFER_NO_DEVICE:
-    iStatus = LIBUSB_ERROR_NO_DEVICE;
-    break;
+// Submit a transfer previously reserved & filled, and commit it to its queue. If one of its
+// sub-transfers is rejected after others have been submitted, the transfer is committed anyway,
+// but aborted so that it completes with an error. If the endpoint is halted while an earlier
+// stall is recovered, the transfer is committed held instead, so it's resubmitted after the
+// transfers already waiting, rather than stalling ahead of them. Called with the device lock
+// held, which also keeps the completion callback out until we're done here.
+//
+static USBStatus submitTransfer(
+  struct USBDevice *dev, struct UnboundedQueue *queue, struct TransferWrapper *wrapper,
+  uint64 tag, const char *func, const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  const struct StallRecovery *const recovery =
+    &dev->stalls[QUEUE_INDEX(wrapper->transfers[0]->endpoint)];
+  int iStatus = LIBUSB_SUCCESS;
+  size_t i;
+  wrapper->numPending = 0;
+  wrapper->aborted = false;
+  wrapper->status = LIBUSB_TRANSFER_COMPLETED;
+  if (recovery->recovering) {
+    // Should recovery fail, it finishes as if cancelled
+    for (i = 0; i < wrapper->numUsed; i++) {
+      wrapper->transfers[i]->status = LIBUSB_TRANSFER_CANCELLED;
+      wrapper->transfers[i]->actual_length = 0;
+    }
+    wrapper->resumeIndex = 0;
+    wrapper->held = true;
+  } else {
+    while (wrapper->numPending < wrapper->numUsed) {
+      iStatus = libusb_submit_transfer(wrapper->transfers[wrapper->numPending]);
+      if (iStatus) {
+        break;
+      }
+      wrapper->numPending++;
+    }
+    CHECK_STATUS(
+      wrapper->numPending == 0, USB_ASYNC_SUBMIT, cleanup,
+      "%s(): Submission error: %s", func, libusb_error_name(iStatus));
+    if (iStatus) {
+      wrapper->numUsed = wrapper->numPending;
+      wrapper->status = LIBUSB_TRANSFER_ERROR;
+      wrapper->aborted = true;
+      cancelSubTransfers(wrapper);
+    }
+  }
+  wrapper->id = dev->numSubmitted++;
+  wrapper->tag = tag;
+  queueCommitPut(queue);
+  dev->numOutstanding++;
+cleanup:
+  return retVal;
+}
+
+// Remove a transfer from its queue. Its library buffer, if any, stays with it, because the
+// caller's report may point into it, until the slot is next reserved. Called with the device
+// lock held.
+//
+static void retireTransfer(struct USBDevice *dev, struct UnboundedQueue *queue, size_t offset) {
+  struct TransferWrapper *wrapper;
+  if (queuePeek(queue, offset, (Item*)&wrapper) == USB_SUCCESS) {
+    if (wrapper->completed) {
+      dev->numReady--;
+    } else if (wrapper->flags.isPoll) {
+      dev->numArmed--;
+    }
+  }
+  queueCommitTakeAt(queue, offset);
+  dev->numOutstanding--;
+}
+
+// Translate the LibUSB status of a finished transfer.
+//
+static USBStatus translateTransferStatus(
+  enum libusb_transfer_status status, const char *func, const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  int iStatus;
+  switch (status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    iStatus = 0;
+    break;
+  case LIBUSB_TRANSFER_TIMED_OUT:
+    iStatus = LIBUSB_ERROR_TIMEOUT;
+    break;
+  case LIBUSB_TRANSFER_STALL:
+    iStatus = LIBUSB_ERROR_PIPE;
+    break;
+  case LIBUSB_TRANSFER_OVERFLOW:
+    iStatus = LIBUSB_ERROR_OVERFLOW;
+    break;
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    iStatus = LIBUSB_ERROR_NO_DEVICE;
+    break;
   case LIBUSB_TRANSFER_ERROR:
   case LIBUSB_TRANSFER_CANCELLED:
     iStatus = LIBUSB_ERROR_IO;
@@ -582,17 +1146,2233 @@ DLLEXPORT(USBStatus) usbBulkAwaitCompletion(
     iStatus = LIBUSB_ERROR_OTHER;
   }
   CHECK_STATUS(
-    iStatus == LIBUSB_ERROR_TIMEOUT, USB_TIMEOUT, commit,
-    "usbBulkAwaitCompletion(): Timeout");
+    iStatus == LIBUSB_ERROR_TIMEOUT, USB_TIMEOUT, cleanup,
+    "%s(): Timeout", func);
   CHECK_STATUS(
-    iStatus, USB_ASYNC_TRANSFER, commit,
-    "usbBulkAwaitCompletion(): Transfer error: %s", libusb_error_name(iStatus));
-commit:
-  queueCommitTake(&dev->queue);
+    iStatus, USB_ASYNC_TRANSFER, cleanup,
+    "%s(): Transfer error: %s", func, libusb_error_name(iStatus));
+cleanup:
+  return retVal;
+}
+
+// Populate a completion report from a finished transfer, and translate its LibUSB status.
+//
+static USBStatus getCompletionReport(
+  const struct TransferWrapper *wrapper, struct CompletionReport *report, const char *func,
+  const char **error)
+{
+  struct libusb_transfer *const transfer = wrapper->transfers[0];
+  report->buffer = (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) ?
+    libusb_control_transfer_get_data(transfer) :
+    transfer->buffer;
+  report->requestLength = wrapper->length;
+  report->actualLength = wrapper->actualLength;
+  report->flags = wrapper->flags;
+  report->id = wrapper->id;
+  report->tag = wrapper->tag;
+  report->transferStatus = (int)wrapper->status;
+  report->endpoint = transfer->endpoint;
+  report->streamId = wrapper->streamId;
+  report->packets = wrapper->numPackets ? wrapper->packets : NULL;
+  report->numPackets = wrapper->numPackets;
+  return translateTransferStatus(wrapper->status, func, error);
+}
+
+// Hand each completed transfer at the head of a queue to the device's completion callback.
+// Called with the device lock held; the lock is dropped around each call to the callback, so
+// it may submit more work. The head is marked while it's being delivered, so another thread
+// arriving here meanwhile leaves it, and what follows it, to the thread already delivering.
+//
+static void deliverCompletions(struct USBDevice *dev, struct UnboundedQueue *queue) {
+  struct TransferWrapper *wrapper;
+  struct CompletionReport report;
+  USBCompletionCallback callback;
+  void *userData;
+  USBStatus status;
+  while (
+    dev->callback &&
+    queueTake(queue, (Item*)&wrapper) == USB_SUCCESS &&
+    wrapper->completed && !wrapper->delivering)
+  {
+    callback = dev->callback;
+    userData = dev->callbackData;
+    status = getCompletionReport(wrapper, &report, "usbSetCompletionCallback", NULL);
+    wrapper->delivering = true;
+    dev->numDelivering++;
+    mutexUnlock(&dev->lock);
+    callback(dev, &report, status, userData);
+    mutexLock(&dev->lock);
+    wrapper->delivering = false;
+    dev->numDelivering--;
+    wrapper->bufPtr = NULL;
+    retireTransfer(dev, queue, 0);
+  }
+}
+
+// Summarise the packets of a finished isochronous transfer, returning the total bytes moved.
+//
+static uint32 getIsoPacketReports(
+  const struct libusb_transfer *transfer, struct IsoPacketReport *packets)
+{
+  const struct libusb_iso_packet_descriptor *desc;
+  uint32 offset = 0, actualLength = 0;
+  int i;
+  for (i = 0; i < transfer->num_iso_packets; i++) {
+    desc = &transfer->iso_packet_desc[i];
+    packets[i].offset = offset;
+    packets[i].actualLength = desc->actual_length;
+    packets[i].status = translateTransferStatus(desc->status, NULL, NULL);
+    offset += desc->length;
+    actualLength += desc->actual_length;
+  }
+  return actualLength;
+}
+
+// Once all its sub-transfers are done, work out how a logical transfer went overall. A short or
+// failed sub-transfer ends it; anything after that was cancelled.
+//
+static void aggregateSubTransfers(struct TransferWrapper *wrapper) {
+  const struct libusb_transfer *transfer;
+  enum libusb_transfer_status status = LIBUSB_TRANSFER_COMPLETED;
+  uint32 actualLength = 0;
+  size_t i;
+  if (wrapper->numPackets) {
+    // An isochronous transfer succeeds or fails packet by packet
+    transfer = wrapper->transfers[0];
+    wrapper->actualLength = getIsoPacketReports(transfer, wrapper->packets);
+    if (wrapper->status == LIBUSB_TRANSFER_COMPLETED) {
+      wrapper->status = transfer->status;
+    }
+    return;
+  }
+  if (wrapper->controlDest) {
+    // A control read's data stage lands after the setup packet; give the caller a copy
+    transfer = wrapper->transfers[0];
+    memcpy(
+      wrapper->controlDest, libusb_control_transfer_get_data((struct libusb_transfer *)transfer),
+      (size_t)transfer->actual_length);
+  }
+  for (i = 0; i < wrapper->numUsed; i++) {
+    transfer = wrapper->transfers[i];
+    actualLength += (uint32)transfer->actual_length;
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+      status = transfer->status;
+      break;
+    }
+    if (transfer->actual_length < transfer->length) {
+      break;
+    }
+  }
+  wrapper->actualLength = actualLength;
+  if (wrapper->status == LIBUSB_TRANSFER_COMPLETED) {
+    wrapper->status = status;
+  }
+}
+
+// Submit a read into a library buffer on a continuously-polled interrupt endpoint. Called with
+// the device lock held.
+//
+static USBStatus submitPoll(
+  struct USBDevice *dev, uint8 endpoint, const char *func, const char **error)
+{
+  USBStatus retVal;
+  const struct InterruptPoll *const poll = &dev->polls[endpoint & 0x0F];
+  struct UnboundedQueue *queue;
+  struct TransferWrapper *wrapper;
+  retVal = reserveSlot(dev, endpoint, &queue, &wrapper, func, error);
+  CHECK_STATUS(retVal, retVal, cleanup);
+  wrapper->flags.isRead = 1;
+  wrapper->flags.isPoll = 1;
+  retVal = getTransferBuffer(dev, wrapper, func, error);
+  CHECK_STATUS(retVal, retVal, cleanup);
+  retVal = fillBulkTransfer(
+    wrapper, endpoint, wrapper->buffer, poll->length, poll->timeout, func, error);
+  CHECK_STATUS(retVal, retVal, cleanup);
+  makeInterruptTransfer(wrapper);
+  retVal = submitTransfer(dev, queue, wrapper, poll->tag, func, error);
+  CHECK_STATUS(retVal, retVal, cleanup);
+  dev->numArmed++;
+cleanup:
+  return retVal;
+}
+
+// Re-arm a polled endpoint straight from the completion of its last read, so it's never left
+// unarmed. Polling stops if that read failed, or if the new one can't be submitted, and the read
+// is flagged so its report says so. Called with the device lock held.
+//
+static void rearmPoll(struct USBDevice *dev, struct TransferWrapper *wrapper) {
+  const uint8 endpoint = wrapper->transfers[0]->endpoint;
+  struct InterruptPoll *const poll = &dev->polls[endpoint & 0x0F];
+  if (poll->active) {
+    if (
+      wrapper->status != LIBUSB_TRANSFER_COMPLETED ||
+      submitPoll(dev, endpoint, "rearmPoll", NULL) != USB_SUCCESS)
+    {
+      poll->active = false;
+      wrapper->flags.pollStopped = 1;
+    }
+  }
+}
+
+// Mark a transfer whose sub-transfers have all finished as completed. The caller must then wake
+// any waiters, or deliver it to the completion callback. Called with the device lock held.
+//
+static void finishTransfer(struct USBDevice *dev, struct TransferWrapper *wrapper) {
+  aggregateSubTransfers(wrapper);
+  wrapper->completed = 1;
+  wrapper->completionOrder = dev->numCompleted++;
+  dev->numReady++;
+  dev->anyCompleted = 1;
+  if (wrapper->flags.isPoll) {
+    dev->numArmed--;
+    rearmPoll(dev, wrapper);
+  }
+}
+
+// Resubmit a held transfer from its resume point. Returns false if nothing could be submitted,
+// in which case the transfer has failed. Called with the device lock held.
+//
+static bool resubmitTransfer(struct TransferWrapper *wrapper) {
+  size_t i;
+  wrapper->numPending = 0;
+  wrapper->aborted = false;
+  wrapper->status = LIBUSB_TRANSFER_COMPLETED;
+  for (i = wrapper->resumeIndex; i < wrapper->numUsed; i++) {
+    if (libusb_submit_transfer(wrapper->transfers[i])) {
+      break;
+    }
+    wrapper->numPending++;
+  }
+  if (i < wrapper->numUsed) {
+    // As in submitTransfer(), anything after a rejected sub-transfer is abandoned
+    wrapper->numUsed = i;
+    wrapper->status = LIBUSB_TRANSFER_ERROR;
+    wrapper->aborted = true;
+    cancelSubTransfers(wrapper);
+  }
+  return wrapper->numPending != 0;
+}
+
+// Once everything behind a stalled transfer has come back, clear the halt and resubmit the
+// held transfers in their original order; or, if the device is being drained, just let them
+// finish. Called with the device lock held.
+//
+static void resumeAfterStall(
+  struct USBDevice *dev, struct UnboundedQueue *queue, struct StallRecovery *recovery,
+  uint8 endpoint)
+{
+  struct TransferWrapper *wrapper;
+  size_t i;
+  const bool cleared = !dev->draining && libusb_clear_halt(dev->handle, endpoint) == 0;
+  recovery->recovering = false;
+  if (cleared) {
+    recovery->numRecoveries++;
+  }
+  for (i = 0; queuePeek(queue, i, (Item*)&wrapper) == USB_SUCCESS; i++) {
+    if (wrapper->held) {
+      wrapper->held = false;
+      if (!cleared || !resubmitTransfer(wrapper)) {
+        finishTransfer(dev, wrapper);
+      }
+    }
+  }
+}
+
+// Called as each transfer finishes. If it stalled on an endpoint with a recovery policy, hold
+// it back and cancel everything behind it, so the lot can be resubmitted in order once the halt
+// is cleared. Returns true if the transfer is being held. Called with the device lock held.
+//
+static bool recoverFromStall(struct USBDevice *dev, struct TransferWrapper *wrapper) {
+  const uint8 endpoint = wrapper->transfers[0]->endpoint;
+  struct UnboundedQueue *const queue = &dev->queues[QUEUE_INDEX(endpoint)];
+  struct StallRecovery *const recovery = &dev->stalls[QUEUE_INDEX(endpoint)];
+  const struct libusb_transfer *transfer;
+  struct TransferWrapper *other;
+  size_t i, stalled;
+  bool found = false;
+  if (recovery->recovering) {
+    // One of the transfers cancelled behind the stalled one has come back
+    if (wrapper->held) {
+      if (--recovery->numAwaiting == 0) {
+        resumeAfterStall(dev, queue, recovery, endpoint);
+      }
+      return true;
+    }
+    return false;
+  }
+  if (
+    recovery->maxRetries == 0 || dev->draining ||
+    (wrapper->transfers[0]->type != LIBUSB_TRANSFER_TYPE_BULK &&
+     wrapper->transfers[0]->type != LIBUSB_TRANSFER_TYPE_INTERRUPT))
+  {
+    return false;
+  }
+
+  // Find the stalled sub-transfer. Data moved from there on can't be replayed without being
+  // duplicated or lost, so in that case the transfer just fails.
+  for (stalled = 0; stalled < wrapper->numUsed; stalled++) {
+    if (wrapper->transfers[stalled]->status == LIBUSB_TRANSFER_STALL) {
+      break;
+    }
+  }
+  if (stalled == wrapper->numUsed) {
+    return false;
+  }
+  recovery->numStalls++;
+  for (i = stalled; i < wrapper->numUsed; i++) {
+    transfer = wrapper->transfers[i];
+    if (transfer->actual_length) {
+      return false;
+    }
+  }
+  if (wrapper->numRetries >= recovery->maxRetries) {
+    return false;
+  }
+  wrapper->numRetries++;
+  wrapper->resumeIndex = stalled;
+  wrapper->held = true;
+  recovery->recovering = true;
+  recovery->numAwaiting = 0;
+
+  // Everything submitted after it is stuck behind the halt; pull it back for resubmission too
+  for (i = 0; queuePeek(queue, i, (Item*)&other) == USB_SUCCESS; i++) {
+    if (other == wrapper) {
+      found = true;
+    } else if (found && !other->completed && other->numPending) {
+      other->resumeIndex = 0;
+      other->held = true;
+      recovery->numAwaiting++;
+      cancelSubTransfers(other);
+    }
+  }
+  if (recovery->numAwaiting == 0) {
+    resumeAfterStall(dev, queue, recovery, endpoint);
+  }
+  return true;
+}
+
+static void LIBUSB_CALL bulk_transfer_cb(struct libusb_transfer *transfer) {
+  struct TransferWrapper *wrapper = transfer->user_data;
+  struct USBDevice *dev = wrapper->dev;
+  mutexLock(&dev->lock);
+  if (
+    !wrapper->aborted && wrapper->numUsed > 1 &&
+    (transfer->status != LIBUSB_TRANSFER_COMPLETED || transfer->actual_length < transfer->length))
+  {
+    wrapper->aborted = true;
+    cancelSubTransfers(wrapper);
+  }
+  if (--wrapper->numPending) {
+    mutexUnlock(&dev->lock);
+    return;
+  }
+  if (!recoverFromStall(dev, wrapper)) {
+    finishTransfer(dev, wrapper);
+  }
+  if (dev->callback && !dev->draining) {
+    deliverCompletions(dev, &dev->queues[QUEUE_INDEX(transfer->endpoint)]);
+  } else {
+    condBroadcast(&dev->completion);
+  }
+  mutexUnlock(&dev->lock);
+}
+
+DLLEXPORT(USBStatus) usbBulkWriteAsync(
+  struct USBDevice *dev, uint8 endpoint, const uint8 *buffer, uint32 length, uint32 timeout,
+  uint64 tag, const char **error)
+{
+  USBStatus retVal;
+  struct UnboundedQueue *queue;
+  struct TransferWrapper *wrapper;
+  mutexLock(&dev->lock);
+  retVal = reserveTransfer(
+    dev, LIBUSB_ENDPOINT_OUT | endpoint, &queue, &wrapper, "usbBulkWriteAsync", error);
+  CHECK_STATUS(retVal, retVal, cleanup);
+  wrapper->flags.isRead = 0;
+  retVal = fillBulkTransfer(
+    wrapper, LIBUSB_ENDPOINT_OUT | endpoint, (uint8 *)buffer, length, timeout,
+    "usbBulkWriteAsync", error);
+  CHECK_STATUS(retVal, retVal, cleanup);
+  retVal = submitTransfer(dev, queue, wrapper, tag, "usbBulkWriteAsync", error);
+cleanup:
+  mutexUnlock(&dev->lock);
+  return retVal;
+}
+
+DLLEXPORT(USBStatus) usbBulkWritevAsync(
+  struct USBDevice *dev, uint8 endpoint, const struct BulkSegment *segments, size_t count,
+  uint32 timeout, uint64 tag, const char **error)
+{
+  USBStatus retVal;
+  struct UnboundedQueue *queue;
+  struct TransferWrapper *wrapper;
+  mutexLock(&dev->lock);
+  retVal = reserveTransfer(
+    dev, LIBUSB_ENDPOINT_OUT | endpoint, &queue, &wrapper, "usbBulkWritevAsync", error);
+  CHECK_STATUS(retVal, retVal, cleanup);
+  wrapper->flags.isRead = 0;
+  retVal = fillGatherTransfer(
+    dev, wrapper, LIBUSB_ENDPOINT_OUT | endpoint, segments, count, timeout,
+    "usbBulkWritevAsync", error);
+  CHECK_STATUS(retVal, retVal, cleanup);
+  retVal = submitTransfer(dev, queue, wrapper, tag, "usbBulkWritevAsync", error);
+cleanup:
+  mutexUnlock(&dev->lock);
+  return retVal;
+}
+
+// Plan the pieces exactly as usbBulkWritevAsync() would, using a transfer that never joins a
+// queue, then write them one after another.
+//
+DLLEXPORT(USBStatus) usbBulkWritev(
+  struct USBDevice *dev, uint8 endpoint, const struct BulkSegment *segments, size_t count,
+  uint32 timeout, const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  struct TransferWrapper *wrapper = createTransfer();
+  const struct libusb_transfer *transfer;
+  int numWritten, status;
+  size_t i;
+  CHECK_STATUS(!wrapper, USB_ALLOC_ERR, exit, "usbBulkWritev(): Out of memory!");
+  wrapper->dev = dev;
+  mutexLock(&dev->lock);
+  retVal = fillGatherTransfer(
+    dev, wrapper, LIBUSB_ENDPOINT_OUT | endpoint, segments, count, timeout,
+    "usbBulkWritev", error);
+  mutexUnlock(&dev->lock);
+  CHECK_STATUS(retVal, retVal, cleanup);
+  for (i = 0; i < wrapper->numUsed; i++) {
+    transfer = wrapper->transfers[i];
+    status = libusb_bulk_transfer(
+      dev->handle, transfer->endpoint, transfer->buffer, transfer->length, &numWritten, timeout);
+    CHECK_STATUS(
+      status == LIBUSB_ERROR_TIMEOUT, USB_TIMEOUT, cleanup,
+      "usbBulkWritev(): Timeout");
+    CHECK_STATUS(
+      status < 0, USB_BULK, cleanup,
+      "usbBulkWritev(): %s", libusb_error_name(status));
+    CHECK_STATUS(
+      numWritten != transfer->length, USB_BULK, cleanup,
+      "usbBulkWritev(): Expected to write %d bytes but actually wrote %d",
+      transfer->length, numWritten);
+  }
+cleanup:
+  mutexLock(&dev->lock);
+  releaseTransferBuffer(dev, wrapper);
+  mutexUnlock(&dev->lock);
+  destroyTransfer(wrapper);
 exit:
   return retVal;
 }
 
-DLLEXPORT(size_t) usbNumOutstandingRequests(struct USBDevice *dev) {
-  return queueSize(&dev->queue);
+DLLEXPORT(USBStatus) usbBufferLease(
+  struct USBDevice *dev, uint8 **buffer, const char **error)
+{
+  USBStatus retVal;
+  struct LibraryBuffer leased;
+  mutexLock(&dev->lock);
+  retVal = takePooledBuffer(dev, &leased, "usbBufferLease", error);
+  CHECK_STATUS(retVal, retVal, cleanup);
+  if (
+    !appendLibraryBuffer(
+      &dev->leased, &dev->numLeased, &dev->leasedCapacity, leased.data, leased.isDevMem))
+  {
+    poolBuffer(dev, leased.data, leased.isDevMem);
+    CHECK_STATUS(true, USB_ALLOC_ERR, cleanup, "usbBufferLease(): Out of memory!");
+  }
+  *buffer = leased.data;
+cleanup:
+  mutexUnlock(&dev->lock);
+  return retVal;
+}
+
+DLLEXPORT(void) usbBufferRelease(struct USBDevice *dev, uint8 *buffer) {
+  size_t i;
+  mutexLock(&dev->lock);
+  for (i = 0; i < dev->numLeased; i++) {
+    if (dev->leased[i].data == buffer) {
+      poolBuffer(dev, buffer, dev->leased[i].isDevMem);
+      dev->leased[i] = dev->leased[--dev->numLeased];
+      break;
+    }
+  }
+  mutexUnlock(&dev->lock);
+}
+
+DLLEXPORT(size_t) usbBufferSize(struct USBDevice *dev) {
+  return dev->options.bufferSize;
+}
+
+// The endpoint isn't known until the buffer is submitted, so hand out the buffer of a spare
+// transfer, and swap it into the endpoint's queue on submission.
+//
+DLLEXPORT(USBStatus) usbBulkWriteAsyncPrepare(
+  struct USBDevice *dev, uint8 **buffer, const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  mutexLock(&dev->lock);
+  if (!dev->spare) {
+    dev->spare = createTransfer();
+    CHECK_STATUS(
+      !dev->spare, USB_ALLOC_ERR, cleanup,
+      "usbBulkWriteAsyncPrepare(): Work queue insertion error");
+  }
+  retVal = getTransferBuffer(dev, dev->spare, "usbBulkWriteAsyncPrepare", error);
+  CHECK_STATUS(retVal, retVal, cleanup);
+  *buffer = dev->spare->buffer;
+cleanup:
+  mutexUnlock(&dev->lock);
+  return retVal;
+}
+
+DLLEXPORT(USBStatus) usbBulkWriteAsyncSubmit(
+  struct USBDevice *dev, uint8 endpoint, uint32 length, uint32 timeout, uint64 tag,
+  const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  struct UnboundedQueue *queue;
+  struct TransferWrapper *wrapper;
+  mutexLock(&dev->lock);
+  CHECK_STATUS(
+    !dev->spare || !dev->spare->buffer, USB_ASYNC_SUBMIT, cleanup,
+    "usbBulkWriteAsyncSubmit(): No buffer was prepared");
+  CHECK_STATUS(
+    length > dev->options.bufferSize, USB_ASYNC_SIZE, cleanup,
+    "usbBulkWriteAsyncSubmit(): Transfer length exceeds buffer size (0x%X)",
+    dev->options.bufferSize);
+  retVal = reserveTransfer(
+    dev, LIBUSB_ENDPOINT_OUT | endpoint, &queue, &wrapper, "usbBulkWriteAsyncSubmit", error);
+  CHECK_STATUS(retVal, retVal, cleanup);
+  {
+    // Swap in the transfer whose buffer was handed out by usbBulkWriteAsyncPrepare()
+    struct TransferWrapper *const prepared = dev->spare;
+    dev->spare = (struct TransferWrapper *)queueExchangePut(queue, prepared);
+    resetTransfer(dev, prepared);
+    wrapper = prepared;
+  }
+  wrapper->flags.isRead = 0;
+  retVal = fillBulkTransfer(
+    wrapper, LIBUSB_ENDPOINT_OUT | endpoint, wrapper->buffer, length, timeout,
+    "usbBulkWriteAsyncSubmit", error);
+  CHECK_STATUS(retVal, retVal, cleanup);
+  retVal = submitTransfer(dev, queue, wrapper, tag, "usbBulkWriteAsyncSubmit", error);
+cleanup:
+  mutexUnlock(&dev->lock);
+  return retVal;
+}
+
+// Submit an async bulk, bulk stream or interrupt read, into the caller's buffer or a library
+// buffer.
+//
+static USBStatus readAsync(
+  struct USBDevice *dev, uint8 endpoint, uint8 *buffer, uint32 length, uint32 timeout,
+  uint64 tag, uint8 type, uint32 streamId, const char *func, const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  struct UnboundedQueue *queue;
+  struct TransferWrapper *wrapper;
+  mutexLock(&dev->lock);
+  CHECK_STATUS(
+    !buffer && length > dev->options.bufferSize, USB_ASYNC_SIZE, cleanup,
+    "%s(): Transfer length exceeds buffer size (0x%X)", func, dev->options.bufferSize);
+  retVal = reserveTransfer(dev, LIBUSB_ENDPOINT_IN | endpoint, &queue, &wrapper, func, error);
+  CHECK_STATUS(retVal, retVal, cleanup);
+  wrapper->flags.isRead = 1;
+  if (buffer) {
+    wrapper->bufPtr = buffer;
+  } else {
+    retVal = getTransferBuffer(dev, wrapper, func, error);
+    CHECK_STATUS(retVal, retVal, cleanup);
+    buffer = wrapper->buffer;
+  }
+  retVal = fillBulkTransfer(
+    wrapper, LIBUSB_ENDPOINT_IN | endpoint, buffer, length, timeout, func, error);
+  CHECK_STATUS(retVal, retVal, cleanup);
+  if (type == LIBUSB_TRANSFER_TYPE_INTERRUPT) {
+    makeInterruptTransfer(wrapper);
+  }
+  #if LIBUSB_API_VERSION >= 0x01000103
+    else if (type == LIBUSB_TRANSFER_TYPE_BULK_STREAM) {
+      makeStreamTransfer(wrapper, streamId);
+    }
+  #else
+    (void)streamId;
+  #endif
+  retVal = submitTransfer(dev, queue, wrapper, tag, func, error);
+cleanup:
+  mutexUnlock(&dev->lock);
+  return retVal;
+}
+
+DLLEXPORT(USBStatus) usbBulkReadAsync(
+  struct USBDevice *dev, uint8 endpoint, uint8 *buffer, uint32 length, uint32 timeout,
+  uint64 tag, const char **error)
+{
+  return readAsync(
+    dev, endpoint, buffer, length, timeout, tag, LIBUSB_TRANSFER_TYPE_BULK, 0,
+    "usbBulkReadAsync", error);
+}
+
+DLLEXPORT(USBStatus) usbInterruptReadAsync(
+  struct USBDevice *dev, uint8 endpoint, uint8 *buffer, uint32 length, uint32 timeout,
+  uint64 tag, const char **error)
+{
+  return readAsync(
+    dev, endpoint, buffer, length, timeout, tag, LIBUSB_TRANSFER_TYPE_INTERRUPT, 0,
+    "usbInterruptReadAsync", error);
+}
+
+DLLEXPORT(USBStatus) usbInterruptWriteAsync(
+  struct USBDevice *dev, uint8 endpoint, const uint8 *buffer, uint32 length, uint32 timeout,
+  uint64 tag, const char **error)
+{
+  USBStatus retVal;
+  struct UnboundedQueue *queue;
+  struct TransferWrapper *wrapper;
+  mutexLock(&dev->lock);
+  retVal = reserveTransfer(
+    dev, LIBUSB_ENDPOINT_OUT | endpoint, &queue, &wrapper, "usbInterruptWriteAsync", error);
+  CHECK_STATUS(retVal, retVal, cleanup);
+  wrapper->flags.isRead = 0;
+  retVal = fillBulkTransfer(
+    wrapper, LIBUSB_ENDPOINT_OUT | endpoint, (uint8 *)buffer, length, timeout,
+    "usbInterruptWriteAsync", error);
+  CHECK_STATUS(retVal, retVal, cleanup);
+  makeInterruptTransfer(wrapper);
+  retVal = submitTransfer(dev, queue, wrapper, tag, "usbInterruptWriteAsync", error);
+cleanup:
+  mutexUnlock(&dev->lock);
+  return retVal;
+}
+
+DLLEXPORT(USBStatus) usbAllocStreams(
+  struct USBDevice *dev, uint32 numStreams, const uint8 *endpoints, int numEndpoints,
+  uint32 *numAllocated, const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  #if LIBUSB_API_VERSION >= 0x01000103
+    const int iStatus = libusb_alloc_streams(
+      dev->handle, numStreams, (unsigned char *)endpoints, numEndpoints);
+    CHECK_STATUS(
+      iStatus < 0, USB_STREAMS, cleanup,
+      "usbAllocStreams(): %s", libusb_error_name(iStatus));
+    *numAllocated = (uint32)iStatus;
+  #else
+    (void)dev;
+    (void)numStreams;
+    (void)endpoints;
+    (void)numEndpoints;
+    *numAllocated = 0;
+    CHECK_STATUS(
+      true, USB_STREAMS, cleanup,
+      "usbAllocStreams(): This LibUSB has no bulk streams support");
+  #endif
+cleanup:
+  return retVal;
+}
+
+DLLEXPORT(USBStatus) usbFreeStreams(
+  struct USBDevice *dev, const uint8 *endpoints, int numEndpoints, const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  #if LIBUSB_API_VERSION >= 0x01000103
+    const int iStatus = libusb_free_streams(
+      dev->handle, (unsigned char *)endpoints, numEndpoints);
+    CHECK_STATUS(
+      iStatus < 0, USB_STREAMS, cleanup,
+      "usbFreeStreams(): %s", libusb_error_name(iStatus));
+  #else
+    (void)dev;
+    (void)endpoints;
+    (void)numEndpoints;
+    CHECK_STATUS(
+      true, USB_STREAMS, cleanup,
+      "usbFreeStreams(): This LibUSB has no bulk streams support");
+  #endif
+cleanup:
+  return retVal;
+}
+
+#if LIBUSB_API_VERSION >= 0x01000103
+  DLLEXPORT(USBStatus) usbBulkStreamReadAsync(
+    struct USBDevice *dev, uint8 endpoint, uint32 streamId, uint8 *buffer, uint32 length,
+    uint32 timeout, uint64 tag, const char **error)
+  {
+    return readAsync(
+      dev, endpoint, buffer, length, timeout, tag, LIBUSB_TRANSFER_TYPE_BULK_STREAM, streamId,
+      "usbBulkStreamReadAsync", error);
+  }
+
+  DLLEXPORT(USBStatus) usbBulkStreamWriteAsync(
+    struct USBDevice *dev, uint8 endpoint, uint32 streamId, const uint8 *buffer, uint32 length,
+    uint32 timeout, uint64 tag, const char **error)
+  {
+    USBStatus retVal;
+    struct UnboundedQueue *queue;
+    struct TransferWrapper *wrapper;
+    mutexLock(&dev->lock);
+    retVal = reserveTransfer(
+      dev, LIBUSB_ENDPOINT_OUT | endpoint, &queue, &wrapper, "usbBulkStreamWriteAsync", error);
+    CHECK_STATUS(retVal, retVal, cleanup);
+    wrapper->flags.isRead = 0;
+    retVal = fillBulkTransfer(
+      wrapper, LIBUSB_ENDPOINT_OUT | endpoint, (uint8 *)buffer, length, timeout,
+      "usbBulkStreamWriteAsync", error);
+    CHECK_STATUS(retVal, retVal, cleanup);
+    makeStreamTransfer(wrapper, streamId);
+    retVal = submitTransfer(dev, queue, wrapper, tag, "usbBulkStreamWriteAsync", error);
+  cleanup:
+    mutexUnlock(&dev->lock);
+    return retVal;
+  }
+#else
+  DLLEXPORT(USBStatus) usbBulkStreamReadAsync(
+    struct USBDevice *dev, uint8 endpoint, uint32 streamId, uint8 *buffer, uint32 length,
+    uint32 timeout, uint64 tag, const char **error)
+  {
+    USBStatus retVal = USB_SUCCESS;
+    (void)dev; (void)endpoint; (void)streamId; (void)buffer; (void)length; (void)timeout;
+    (void)tag;
+    CHECK_STATUS(
+      true, USB_STREAMS, cleanup,
+      "usbBulkStreamReadAsync(): This LibUSB has no bulk streams support");
+  cleanup:
+    return retVal;
+  }
+
+  DLLEXPORT(USBStatus) usbBulkStreamWriteAsync(
+    struct USBDevice *dev, uint8 endpoint, uint32 streamId, const uint8 *buffer, uint32 length,
+    uint32 timeout, uint64 tag, const char **error)
+  {
+    USBStatus retVal = USB_SUCCESS;
+    (void)dev; (void)endpoint; (void)streamId; (void)buffer; (void)length; (void)timeout;
+    (void)tag;
+    CHECK_STATUS(
+      true, USB_STREAMS, cleanup,
+      "usbBulkStreamWriteAsync(): This LibUSB has no bulk streams support");
+  cleanup:
+    return retVal;
+  }
+#endif
+
+// Submit an async vendor control transfer. Reads and writes share endpoint zero's queue, so
+// they complete in the order they were issued, as they do on the bus.
+//
+static USBStatus controlAsync(
+  struct USBDevice *dev, uint8 direction, uint8 bRequest, uint16 wValue, uint16 wIndex,
+  const uint8 *data, uint8 *readDest, uint16 wLength, uint32 timeout, uint64 tag,
+  const char *func, const char **error)
+{
+  USBStatus retVal;
+  struct UnboundedQueue *queue;
+  struct TransferWrapper *wrapper;
+  mutexLock(&dev->lock);
+  CHECK_STATUS(
+    direction == LIBUSB_ENDPOINT_OUT && !data && wLength, USB_INVALID_OPTIONS, cleanup,
+    "%s(): No data supplied for a %d-byte write", func, wLength);
+  retVal = reserveTransfer(dev, 0x00, &queue, &wrapper, func, error);
+  CHECK_STATUS(retVal, retVal, cleanup);
+  wrapper->flags.isRead = (direction == LIBUSB_ENDPOINT_IN) ? 1 : 0;
+  retVal = fillControlTransfer(
+    wrapper, direction | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+    bRequest, wValue, wIndex, wLength, timeout, func, error);
+  CHECK_STATUS(retVal, retVal, cleanup);
+  if (data && wLength) {
+    memcpy(wrapper->control + LIBUSB_CONTROL_SETUP_SIZE, data, wLength);
+  }
+  wrapper->controlDest = readDest;
+  retVal = submitTransfer(dev, queue, wrapper, tag, func, error);
+cleanup:
+  mutexUnlock(&dev->lock);
+  return retVal;
+}
+
+DLLEXPORT(USBStatus) usbControlReadAsync(
+  struct USBDevice *dev, uint8 bRequest, uint16 wValue, uint16 wIndex,
+  uint8 *data, uint16 wLength,
+  uint32 timeout, uint64 tag, const char **error)
+{
+  return controlAsync(
+    dev, LIBUSB_ENDPOINT_IN, bRequest, wValue, wIndex, NULL, data, wLength, timeout, tag,
+    "usbControlReadAsync", error);
+}
+
+DLLEXPORT(USBStatus) usbControlWriteAsync(
+  struct USBDevice *dev, uint8 bRequest, uint16 wValue, uint16 wIndex,
+  const uint8 *data, uint16 wLength,
+  uint32 timeout, uint64 tag, const char **error)
+{
+  return controlAsync(
+    dev, LIBUSB_ENDPOINT_OUT, bRequest, wValue, wIndex, data, NULL, wLength, timeout, tag,
+    "usbControlWriteAsync", error);
+}
+
+DLLEXPORT(USBStatus) usbIsoTransferAsync(
+  struct USBDevice *dev, uint8 endpoint, uint8 *buffer, uint32 numPackets, uint32 packetSize,
+  uint32 timeout, uint64 tag, const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  struct UnboundedQueue *queue;
+  struct TransferWrapper *wrapper;
+  mutexLock(&dev->lock);
+  CHECK_STATUS(
+    numPackets == 0 || packetSize == 0, USB_INVALID_OPTIONS, cleanup,
+    "usbIsoTransferAsync(): At least one packet of at least one byte is needed");
+  CHECK_STATUS(
+    (uint64)numPackets * packetSize > INT_MAX, USB_ASYNC_SIZE, cleanup,
+    "usbIsoTransferAsync(): Transfer length exceeds what LibUSB can submit");
+  CHECK_STATUS(
+    !buffer && numPackets * packetSize > dev->options.bufferSize, USB_ASYNC_SIZE, cleanup,
+    "usbIsoTransferAsync(): Transfer length exceeds buffer size (0x%X)",
+    dev->options.bufferSize);
+  retVal = reserveTransfer(dev, endpoint, &queue, &wrapper, "usbIsoTransferAsync", error);
+  CHECK_STATUS(retVal, retVal, cleanup);
+  wrapper->flags.isRead = (endpoint & LIBUSB_ENDPOINT_IN) ? 1 : 0;
+  if (buffer) {
+    wrapper->bufPtr = buffer;
+  } else {
+    retVal = getTransferBuffer(dev, wrapper, "usbIsoTransferAsync", error);
+    CHECK_STATUS(retVal, retVal, cleanup);
+    buffer = wrapper->buffer;
+  }
+  retVal = fillIsoTransfer(
+    wrapper, endpoint, buffer, numPackets, packetSize, timeout, "usbIsoTransferAsync", error);
+  CHECK_STATUS(retVal, retVal, cleanup);
+  retVal = submitTransfer(dev, queue, wrapper, tag, "usbIsoTransferAsync", error);
+cleanup:
+  mutexUnlock(&dev->lock);
+  return retVal;
+}
+
+DLLEXPORT(USBStatus) usbInterruptPollStart(
+  struct USBDevice *dev, uint8 endpoint, uint32 length, uint32 timeout, uint64 tag,
+  const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  struct InterruptPoll *const poll = &dev->polls[endpoint & 0x0F];
+  mutexLock(&dev->lock);
+  CHECK_STATUS(
+    length > dev->options.bufferSize, USB_ASYNC_SIZE, cleanup,
+    "usbInterruptPollStart(): Transfer length exceeds buffer size (0x%X)",
+    dev->options.bufferSize);
+  if (!poll->active) {
+    poll->length = length;
+    poll->timeout = timeout;
+    poll->tag = tag;
+    retVal = submitPoll(dev, LIBUSB_ENDPOINT_IN | endpoint, "usbInterruptPollStart", error);
+    CHECK_STATUS(retVal, retVal, cleanup);
+    poll->active = true;
+  }
+cleanup:
+  mutexUnlock(&dev->lock);
+  return retVal;
+}
+
+DLLEXPORT(void) usbInterruptPollStop(struct USBDevice *dev, uint8 endpoint) {
+  struct UnboundedQueue *const queue = &dev->queues[QUEUE_INDEX(LIBUSB_ENDPOINT_IN | endpoint)];
+  struct TransferWrapper *wrapper;
+  size_t i;
+  mutexLock(&dev->lock);
+  dev->polls[endpoint & 0x0F].active = false;
+  for (i = 0; queuePeek(queue, i, (Item*)&wrapper) == USB_SUCCESS; i++) {
+    if (wrapper->flags.isPoll && !wrapper->completed) {
+      cancelSubTransfers(wrapper);
+    }
+  }
+  mutexUnlock(&dev->lock);
+}
+
+DLLEXPORT(USBStatus) usbBulkSubmitBatch(
+  struct USBDevice *dev, const struct BulkTransferRequest *requests, size_t count,
+  size_t *numSubmitted, const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  size_t perQueue[NUM_QUEUES] = {0};
+  struct UnboundedQueue *queue;
+  struct TransferWrapper *wrapper;
+  const struct BulkTransferRequest *request;
+  uint8 *buffer;
+  size_t i, index;
+  *numSubmitted = 0;
+  mutexLock(&dev->lock);
+  for (i = 0; i < count; i++) {
+    CHECK_STATUS(
+      !requests[i].buffer && requests[i].length > dev->options.bufferSize, USB_ASYNC_SIZE, cleanup,
+      "usbBulkSubmitBatch(): Transfer %d length exceeds buffer size (0x%X)",
+      (int)i, dev->options.bufferSize);
+    perQueue[QUEUE_INDEX(requests[i].endpoint)]++;
+  }
+
+  // Make room for the whole batch, so running out of memory doesn't leave it half-submitted
+  for (i = 0; i < count; i++) {
+    index = QUEUE_INDEX(requests[i].endpoint);
+    if (perQueue[index]) {
+      retVal = getQueue(dev, requests[i].endpoint, &queue, "usbBulkSubmitBatch", error);
+      CHECK_STATUS(retVal, retVal, cleanup);
+      CHECK_STATUS(
+        dev->options.maxDepth && queueSize(queue) + perQueue[index] > dev->options.maxDepth,
+        USB_QUEUE_FULL, cleanup,
+        "usbBulkSubmitBatch(): Batch would exceed %d transfers in flight on endpoint 0x%02X",
+        (int)dev->options.maxDepth, requests[i].endpoint);
+      retVal = queueReserve(queue, perQueue[index]);
+      CHECK_STATUS(retVal, retVal, cleanup, "usbBulkSubmitBatch(): Work queue insertion error");
+      perQueue[index] = 0;
+    }
+  }
+
+  // Now submit each one in turn; a failure from here on leaves the batch partly submitted
+  for (i = 0; i < count; i++) {
+    request = requests + i;
+    retVal = reserveTransfer(
+      dev, request->endpoint, &queue, &wrapper, "usbBulkSubmitBatch", error);
+    CHECK_STATUS(retVal, retVal, cleanup);
+    wrapper->flags.isRead = (request->endpoint & LIBUSB_ENDPOINT_IN) ? 1 : 0;
+    buffer = request->buffer;
+    if (buffer) {
+      wrapper->bufPtr = buffer;
+    } else {
+      retVal = getTransferBuffer(dev, wrapper, "usbBulkSubmitBatch", error);
+      CHECK_STATUS(retVal, retVal, cleanup);
+      buffer = wrapper->buffer;
+    }
+    retVal = fillBulkTransfer(
+      wrapper, request->endpoint, buffer, request->length, request->timeout,
+      "usbBulkSubmitBatch", error);
+    CHECK_STATUS(retVal, retVal, cleanup);
+    retVal = submitTransfer(dev, queue, wrapper, request->tag, "usbBulkSubmitBatch", error);
+    CHECK_STATUS(retVal, retVal, cleanup);
+    (*numSubmitted)++;
+  }
+cleanup:
+  mutexUnlock(&dev->lock);
+  return retVal;
+}
+
+// Milliseconds left before a deadline set by the await functions, and the same as a timeval
+// for LibUSB. Neither is meaningful for USB_WAIT_FOREVER.
+//
+static uint32 timeRemaining(uint64 deadline) {
+  const uint64 now = clockMillis();
+  return (now < deadline) ? (uint32)(deadline - now) : 0;
+}
+static void toTimeval(uint32 ms, struct timeval *tv) {
+  tv->tv_sec = ms / 1000;
+  tv->tv_usec = 1000 * (ms % 1000);
+}
+
+// Whether a context's event thread is servicing its events.
+//
+static bool isEventThreadRunning(struct USBContext *ctx) {
+  bool running;
+  mutexLock(&ctx->lock);
+  running = ctx->eventThreadRunning && !ctx->eventThreadStop;
+  mutexUnlock(&ctx->lock);
+  return running;
+}
+
+// Sleep until the event thread reports a completion, or ms milliseconds pass. A stopped event
+// thread reports nothing more, so never sleep longer than EVENT_THREAD_POLL_MS; callers re-check
+// isEventThreadRunning() when they wake, and drive LibUSB themselves if it's gone. Called with
+// the device lock held.
+//
+#define EVENT_THREAD_POLL_MS 100
+static void waitForEventThread(struct USBDevice *dev, uint32 ms) {
+  condWaitTimeout(
+    &dev->completion, &dev->lock, ms < EVENT_THREAD_POLL_MS ? ms : EVENT_THREAD_POLL_MS);
+}
+
+// Handle LibUSB events on the caller's thread until the given transfer completes, or the
+// timeout expires. If event handling fails, try to cancel the transfer so it's safe to
+// recycle.
+//
+static int handleEventsUntilComplete(struct TransferWrapper *wrapper, uint32 timeout) {
+  const uint64 deadline = clockMillis() + timeout;
+  struct timeval forever = NO_TIMEOUT;
+  struct timeval tv = NO_TIMEOUT;
+  uint32 remaining = timeout;
+  int *completed = &wrapper->completed;
+  int iStatus;
+  while (*completed == 0) {
+    if (timeout != USB_WAIT_FOREVER) {
+      remaining = timeRemaining(deadline);
+      toTimeval(remaining, &tv);
+    }
+    iStatus = libusb_handle_events_timeout_completed(wrapper->dev->ctx->libusb, &tv, completed);
+    if (iStatus < 0) {
+      if (iStatus == LIBUSB_ERROR_INTERRUPTED) {
+        continue;
+      }
+      if (cancelSubTransfers(wrapper)) {
+        while (*completed == 0) {
+          if (libusb_handle_events_timeout_completed(
+            wrapper->dev->ctx->libusb, &forever, completed) < 0) {
+            break;
+          }
+        }
+      }
+      return iStatus;
+    }
+    if (*completed == 0 && remaining == 0) {
+      return LIBUSB_ERROR_TIMEOUT;
+    }
+  }
+  return LIBUSB_SUCCESS;
+}
+
+// Wait for the transfer at the head of a queue to complete, then report and retire it. If the
+// timeout expires first, the transfer is left where it is. Called with the device lock held.
+//
+static USBStatus awaitQueueHead(
+  struct USBDevice *dev, struct UnboundedQueue *queue, struct CompletionReport *report,
+  uint32 timeout, const char *func, const char **error)
+{
+  USBStatus retVal;
+  const uint64 deadline = clockMillis() + timeout;
+  struct TransferWrapper *wrapper;
+  uint32 remaining;
+  int iStatus;
+  retVal = queueTake(queue, (Item*)&wrapper);
+  CHECK_STATUS(retVal, retVal, exit, "%s(): Work queue fetch error", func);
+  while (wrapper->completed == 0) {
+    remaining = (timeout == USB_WAIT_FOREVER) ? USB_WAIT_FOREVER : timeRemaining(deadline);
+    if (isEventThreadRunning(dev->ctx)) {
+      // The event thread will wake us when it's done
+      CHECK_STATUS(remaining == 0, USB_PENDING, exit);
+      waitForEventThread(dev, remaining);
+    } else {
+      // Drive LibUSB ourselves
+      mutexUnlock(&dev->lock);
+      iStatus = handleEventsUntilComplete(wrapper, remaining);
+      mutexLock(&dev->lock);
+      CHECK_STATUS(iStatus == LIBUSB_ERROR_TIMEOUT, USB_PENDING, exit);
+      CHECK_STATUS(
+        iStatus, USB_ASYNC_EVENT, commit,
+        "%s(): Event error: %s", func, libusb_error_name(iStatus));
+    }
+  }
+  wrapper->bufPtr = NULL;
+  retVal = getCompletionReport(wrapper, report, func, error);
+commit:
+  retireTransfer(dev, queue, 0);
+exit:
+  return retVal;
+}
+
+// The oldest outstanding transfer is at the head of one of the endpoint queues. A poll read still
+// armed is passed over, as it may never complete. Called with the device lock held.
+//
+static struct UnboundedQueue *findOldest(struct USBDevice *dev) {
+  struct UnboundedQueue *oldest = NULL;
+  struct TransferWrapper *wrapper, *oldestWrapper = NULL;
+  size_t i;
+  for (i = 0; i < NUM_QUEUES; i++) {
+    if (
+      queueTake(&dev->queues[i], (Item*)&wrapper) == USB_SUCCESS &&
+      (wrapper->completed || !wrapper->flags.isPoll) &&
+      (oldestWrapper == NULL || (int32)(wrapper->id - oldestWrapper->id) < 0))
+    {
+      oldest = &dev->queues[i];
+      oldestWrapper = wrapper;
+    }
+  }
+  return oldest;
+}
+
+// Await the oldest outstanding transfer on any endpoint.
+//
+static USBStatus awaitOldest(
+  struct USBDevice *dev, struct CompletionReport *report, uint32 timeout, const char *func,
+  const char **error)
+{
+  USBStatus retVal;
+  struct UnboundedQueue *oldest;
+  mutexLock(&dev->lock);
+  oldest = findOldest(dev);
+  CHECK_STATUS(
+    !oldest, USB_EMPTY_QUEUE, cleanup,
+    "%s(): Work queue fetch error", func);
+  retVal = awaitQueueHead(dev, oldest, report, timeout, func, error);
+cleanup:
+  mutexUnlock(&dev->lock);
+  return retVal;
+}
+
+DLLEXPORT(USBStatus) usbBulkAwaitCompletion(
+  struct USBDevice *dev, struct CompletionReport *report, const char **error)
+{
+  return awaitOldest(dev, report, USB_WAIT_FOREVER, "usbBulkAwaitCompletion", error);
+}
+
+DLLEXPORT(USBStatus) usbBulkAwaitCompletionTimeout(
+  struct USBDevice *dev, struct CompletionReport *report, uint32 timeout, const char **error)
+{
+  return awaitOldest(dev, report, timeout, "usbBulkAwaitCompletionTimeout", error);
+}
+
+DLLEXPORT(USBStatus) usbBulkAwaitEndpointCompletion(
+  struct USBDevice *dev, uint8 endpoint, struct CompletionReport *report, const char **error)
+{
+  USBStatus retVal;
+  mutexLock(&dev->lock);
+  retVal = awaitQueueHead(
+    dev, &dev->queues[QUEUE_INDEX(endpoint)], report, USB_WAIT_FOREVER,
+    "usbBulkAwaitEndpointCompletion", error);
+  mutexUnlock(&dev->lock);
+  return retVal;
+}
+
+// Find the outstanding transfer which completed earliest, if any, passing over any which is
+// with the completion callback. Called with the device lock held.
+//
+static bool findFirstCompleted(
+  struct USBDevice *dev, struct UnboundedQueue **queue, size_t *offset,
+  struct TransferWrapper **found)
+{
+  struct TransferWrapper *wrapper;
+  size_t i, j;
+  *found = NULL;
+  for (i = 0; i < NUM_QUEUES; i++) {
+    for (j = 0; queuePeek(&dev->queues[i], j, (Item*)&wrapper) == USB_SUCCESS; j++) {
+      if (
+        wrapper->completed && !wrapper->delivering &&
+        (*found == NULL || (int32)(wrapper->completionOrder - (*found)->completionOrder) < 0))
+      {
+        *found = wrapper;
+        *queue = &dev->queues[i];
+        *offset = j;
+      }
+    }
+  }
+  return *found != NULL;
+}
+
+// Wait until at least minCount of the device's transfers have completed, not counting any with
+// the completion callback, or the timeout expires. If enough have already completed, return at
+// once without handling any events; otherwise, even with a zero timeout, pending events are
+// handled once. Called with the device lock held. Returns the LibUSB status of event-handling.
+//
+static int awaitReady(struct USBDevice *dev, size_t minCount, uint32 timeout) {
+  const uint64 deadline = clockMillis() + timeout;
+  uint32 remaining = timeout;
+  struct timeval tv = NO_TIMEOUT;
+  int iStatus;
+  for (;;) {
+    if (dev->numReady - dev->numDelivering >= minCount) {
+      break;
+    }
+    if (timeout != USB_WAIT_FOREVER) {
+      remaining = timeRemaining(deadline);
+      toTimeval(remaining, &tv);
+    }
+    if (isEventThreadRunning(dev->ctx)) {
+      // The event thread will wake us when something completes
+      if (remaining == 0) {
+        break;
+      }
+      waitForEventThread(dev, remaining);
+    } else {
+      // Drive LibUSB ourselves
+      dev->anyCompleted = 0;
+      mutexUnlock(&dev->lock);
+      iStatus = libusb_handle_events_timeout_completed(
+        dev->ctx->libusb, &tv, &dev->anyCompleted);
+      mutexLock(&dev->lock);
+      if (iStatus < 0 && iStatus != LIBUSB_ERROR_INTERRUPTED) {
+        return iStatus;
+      }
+      if (remaining == 0) {
+        break;
+      }
+    }
+  }
+  return LIBUSB_SUCCESS;
+}
+
+DLLEXPORT(USBStatus) usbBulkAwaitAnyCompletion(
+  struct USBDevice *dev, struct CompletionReport *report, const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  struct UnboundedQueue *queue;
+  struct TransferWrapper *wrapper;
+  size_t offset;
+  int iStatus;
+  mutexLock(&dev->lock);
+  CHECK_STATUS(
+    dev->numOutstanding == dev->numArmed, USB_EMPTY_QUEUE, unlock,
+    "usbBulkAwaitAnyCompletion(): Work queue fetch error");
+  do {
+    iStatus = awaitReady(dev, 1, USB_WAIT_FOREVER);
+    CHECK_STATUS(
+      iStatus, USB_ASYNC_EVENT, unlock,
+      "usbBulkAwaitAnyCompletion(): Event error: %s", libusb_error_name(iStatus));
+    CHECK_STATUS(
+      dev->numOutstanding == dev->numArmed, USB_EMPTY_QUEUE, unlock,
+      "usbBulkAwaitAnyCompletion(): Work queue fetch error");
+  } while (!findFirstCompleted(dev, &queue, &offset, &wrapper));
+  wrapper->bufPtr = NULL;
+  retVal = getCompletionReport(wrapper, report, "usbBulkAwaitAnyCompletion", error);
+  retireTransfer(dev, queue, offset);
+unlock:
+  mutexUnlock(&dev->lock);
+  return retVal;
+}
+
+DLLEXPORT(USBStatus) usbBulkAwaitCompletions(
+  struct USBDevice *dev, struct CompletionReport *reports, size_t minCount, size_t maxCount,
+  uint32 timeout, size_t *numReports, const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  struct UnboundedQueue *queue;
+  struct TransferWrapper *wrapper;
+  size_t offset;
+  int iStatus;
+  *numReports = 0;
+  mutexLock(&dev->lock);
+  CHECK_STATUS(
+    dev->numOutstanding == dev->numArmed, USB_EMPTY_QUEUE, unlock,
+    "usbBulkAwaitCompletions(): Work queue fetch error");
+  if (minCount > dev->numOutstanding - dev->numArmed) {
+    minCount = dev->numOutstanding - dev->numArmed;
+  }
+  iStatus = awaitReady(dev, minCount, timeout);
+  CHECK_STATUS(
+    iStatus, USB_ASYNC_EVENT, unlock,
+    "usbBulkAwaitCompletions(): Event error: %s", libusb_error_name(iStatus));
+  while (*numReports < maxCount && findFirstCompleted(dev, &queue, &offset, &wrapper)) {
+    wrapper->bufPtr = NULL;
+    retVal = getCompletionReport(
+      wrapper, reports + *numReports, "usbBulkAwaitCompletions", error);
+    retireTransfer(dev, queue, offset);
+    (*numReports)++;
+    CHECK_STATUS(retVal, retVal, unlock);
+  }
+unlock:
+  mutexUnlock(&dev->lock);
+  return retVal;
+}
+
+DLLEXPORT(size_t) usbNumOutstandingRequests(struct USBDevice *dev) {
+  size_t retVal;
+  mutexLock(&dev->lock);
+  retVal = dev->numOutstanding - dev->numArmed;  // armed poll reads may never complete
+  mutexUnlock(&dev->lock);
+  return retVal;
+}
+
+// Count the transfers in the selected queues which are still in flight. Called with the device
+// lock held.
+//
+static size_t countIncomplete(struct USBDevice *dev, uint8 endpoint) {
+  struct TransferWrapper *wrapper;
+  size_t i, j, count = 0;
+  for (i = 0; i < NUM_QUEUES; i++) {
+    if (endpoint == USB_ALL_ENDPOINTS || i == QUEUE_INDEX(endpoint)) {
+      for (j = 0; queuePeek(&dev->queues[i], j, (Item*)&wrapper) == USB_SUCCESS; j++) {
+        if (!wrapper->completed) {
+          count++;
+        }
+      }
+    }
+  }
+  return count;
+}
+
+DLLEXPORT(USBStatus) usbCancelAll(
+  struct USBDevice *dev, uint8 endpoint, struct DrainReport *report, const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  struct DrainReport counts = {0, 0, 0};
+  struct timeval forever = NO_TIMEOUT;
+  struct UnboundedQueue *queue;
+  struct TransferWrapper *wrapper;
+  size_t i, j;
+  int iStatus;
+  mutexLock(&dev->lock);
+  dev->draining = true;
+
+  // Stop polls re-arming, then cancel everything at once so it can all be reaped together
+  for (i = 0; i < NUM_QUEUES; i++) {
+    if (endpoint == USB_ALL_ENDPOINTS || i == QUEUE_INDEX(endpoint)) {
+      if (i & 0x10) {
+        dev->polls[i & 0x0F].active = false;
+      }
+      for (j = 0; queuePeek(&dev->queues[i], j, (Item*)&wrapper) == USB_SUCCESS; j++) {
+        if (!wrapper->completed) {
+          cancelSubTransfers(wrapper);
+        }
+      }
+    }
+  }
+  while (countIncomplete(dev, endpoint)) {
+    if (isEventThreadRunning(dev->ctx)) {
+      waitForEventThread(dev, USB_WAIT_FOREVER);
+    } else {
+      dev->anyCompleted = 0;
+      mutexUnlock(&dev->lock);
+      iStatus = libusb_handle_events_timeout_completed(
+        dev->ctx->libusb, &forever, &dev->anyCompleted);
+      mutexLock(&dev->lock);
+      CHECK_STATUS(
+        iStatus < 0 && iStatus != LIBUSB_ERROR_INTERRUPTED, USB_ASYNC_EVENT, cleanup,
+        "usbCancelAll(): Event error: %s", libusb_error_name(iStatus));
+    }
+  }
+
+  // Everything selected has finished one way or another; retire it all unreported, except a
+  // head still with the completion callback, which its deliverer will retire
+  for (i = 0; i < NUM_QUEUES; i++) {
+    if (endpoint == USB_ALL_ENDPOINTS || i == QUEUE_INDEX(endpoint)) {
+      queue = &dev->queues[i];
+      j = 0;
+      while (queuePeek(queue, j, (Item*)&wrapper) == USB_SUCCESS) {
+        if (wrapper->delivering) {
+          j++;
+          continue;
+        }
+        if (wrapper->status == LIBUSB_TRANSFER_COMPLETED) {
+          counts.numCompleted++;
+        } else if (wrapper->status == LIBUSB_TRANSFER_CANCELLED) {
+          counts.numCancelled++;
+        } else {
+          counts.numFailed++;
+        }
+        wrapper->bufPtr = NULL;
+        retireTransfer(dev, queue, j);
+      }
+    }
+  }
+cleanup:
+  dev->draining = false;
+  mutexUnlock(&dev->lock);
+  if (report) {
+    *report = counts;
+  }
+  return retVal;
+}
+
+DLLEXPORT(USBStatus) usbSetStallPolicy(
+  struct USBDevice *dev, uint8 endpoint, uint32 maxRetries, const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  CHECK_STATUS(
+    (endpoint & 0x0F) == 0, USB_INVALID_OPTIONS, exit,
+    "usbSetStallPolicy(): The control endpoint has no stall recovery");
+  mutexLock(&dev->lock);
+  dev->stalls[QUEUE_INDEX(endpoint)].maxRetries = maxRetries;
+  mutexUnlock(&dev->lock);
+exit:
+  return retVal;
+}
+
+DLLEXPORT(void) usbGetStallStats(
+  struct USBDevice *dev, uint8 endpoint, struct StallStats *stats)
+{
+  const struct StallRecovery *const recovery = &dev->stalls[QUEUE_INDEX(endpoint)];
+  mutexLock(&dev->lock);
+  stats->numStalls = recovery->numStalls;
+  stats->numRecoveries = recovery->numRecoveries;
+  mutexUnlock(&dev->lock);
+}
+
+DLLEXPORT(void) usbSetCompletionCallback(
+  struct USBDevice *dev, USBCompletionCallback callback, void *userData)
+{
+  size_t i;
+  mutexLock(&dev->lock);
+  dev->callback = callback;
+  dev->callbackData = userData;
+  for (i = 0; i < NUM_QUEUES; i++) {
+    deliverCompletions(dev, &dev->queues[i]);  // anything that finished before registration
+  }
+  mutexUnlock(&dev->lock);
+}
+
+// A filled buffer waiting for the consumer of a read stream
+//
+struct StreamEntry {
+  uint8 *buffer;
+  uint32 actualLength;
+  enum libusb_transfer_status status;
+  struct IsoPacketReport *packets;     // this slot's per-packet results, if isochronous
+};
+
+// Each stream has twice as many buffers as transfers, so the consumer can fall up to a whole
+// ring behind before the transfers stall waiting for buffers.
+//
+struct USBReadStream {
+  struct USBDevice *dev;
+  uint8 endpoint;
+  uint32 transferSize;
+  uint32 numPackets;                   // packets per transfer, if isochronous
+  size_t depth;                        // number of transfers
+  size_t numBuffers;
+  struct libusb_transfer **transfers;
+  struct LibraryBuffer *buffers;       // all of them, for freeing
+  struct IsoPacketReport *packets;     // numPackets for each ring slot
+  uint8 **freeBuffers;                 // buffers neither in flight nor waiting in the ring
+  size_t numFree;
+  struct libusb_transfer **idle;       // transfers waiting for the consumer to free a buffer
+  size_t numIdle;
+  struct StreamEntry *ring;            // filled buffers, in the order they completed
+  size_t ringHead;
+  size_t ringCount;
+  size_t numInFlight;
+  uint8 *held;                         // buffer last handed to the consumer
+  uint32 numDelivered;
+  bool stopping;
+  bool failed;                         // a transfer failed, so nothing more is submitted
+  int anyCompleted;
+};
+
+static void destroyReadStream(struct USBReadStream *stream) {
+  size_t i;
+  if (stream->transfers) {
+    for (i = 0; i < stream->depth; i++) {
+      libusb_free_transfer(stream->transfers[i]);
+    }
+  }
+  if (stream->buffers) {
+    for (i = 0; i < stream->numBuffers; i++) {
+      if (stream->buffers[i].data) {
+        freeLibraryBuffer(
+          stream->dev, stream->buffers[i].data, stream->transferSize, stream->buffers[i].isDevMem);
+      }
+    }
+  }
+  free((void*)stream->transfers);
+  free((void*)stream->buffers);
+  free((void*)stream->packets);
+  free((void*)stream->freeBuffers);
+  free((void*)stream->idle);
+  free((void*)stream->ring);
+  free((void*)stream);
+}
+
+// Cancel everything, so nothing more completes. Called with the device lock held.
+//
+static void abortReadStream(struct USBReadStream *stream) {
+  size_t i;
+  stream->failed = true;
+  for (i = 0; i < stream->depth; i++) {
+    libusb_cancel_transfer(stream->transfers[i]);
+  }
+}
+
+// Put a stream transfer back in flight with a free buffer, or park it until the consumer gives
+// one back. Called with the device lock held.
+//
+static void resubmitStreamTransfer(struct USBReadStream *stream, struct libusb_transfer *transfer) {
+  if (stream->numFree == 0) {
+    stream->idle[stream->numIdle++] = transfer;
+    return;
+  }
+  transfer->buffer = stream->freeBuffers[--stream->numFree];
+  if (libusb_submit_transfer(transfer) == LIBUSB_SUCCESS) {
+    stream->numInFlight++;
+  } else {
+    stream->freeBuffers[stream->numFree++] = transfer->buffer;
+    stream->idle[stream->numIdle++] = transfer;
+    abortReadStream(stream);
+  }
+}
+
+// Resubmit each transfer straight from its completion, rather than waiting for the consumer to
+// come round, so the endpoint always has reads queued.
+//
+static void LIBUSB_CALL stream_read_cb(struct libusb_transfer *transfer) {
+  struct USBReadStream *stream = transfer->user_data;
+  struct USBDevice *dev = stream->dev;
+  struct StreamEntry *entry;
+  mutexLock(&dev->lock);
+  stream->numInFlight--;
+  stream->anyCompleted = 1;
+  if (stream->failed || stream->stopping) {
+    stream->freeBuffers[stream->numFree++] = transfer->buffer;
+    stream->idle[stream->numIdle++] = transfer;
+  } else {
+    entry = &stream->ring[(stream->ringHead + stream->ringCount++) % stream->numBuffers];
+    entry->buffer = transfer->buffer;
+    entry->actualLength = stream->numPackets ?
+      getIsoPacketReports(transfer, entry->packets) :
+      (uint32)transfer->actual_length;
+    entry->status = transfer->status;
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+      resubmitStreamTransfer(stream, transfer);
+    } else {
+      stream->idle[stream->numIdle++] = transfer;
+      abortReadStream(stream);
+    }
+  }
+  condBroadcast(&dev->completion);
+  mutexUnlock(&dev->lock);
+}
+
+// Give the consumer's last buffer back, and use it to restart a parked transfer. Called with
+// the device lock held.
+//
+static void releaseStreamBuffer(struct USBReadStream *stream) {
+  if (stream->held) {
+    stream->freeBuffers[stream->numFree++] = stream->held;
+    stream->held = NULL;
+    if (stream->numIdle && !stream->failed && !stream->stopping) {
+      resubmitStreamTransfer(stream, stream->idle[--stream->numIdle]);
+    }
+  }
+}
+
+// Cancel all the stream's transfers and wait for them to come back. Returns false if event
+// handling failed with some still in flight, in which case LibUSB still owns them, and the
+// stream must not be freed. Called with the device lock held.
+//
+static bool stopReadStream(struct USBReadStream *stream) {
+  struct USBDevice *const dev = stream->dev;
+  struct timeval forever = NO_TIMEOUT;
+  int iStatus;
+  stream->stopping = true;
+  abortReadStream(stream);
+  while (stream->numInFlight) {
+    if (isEventThreadRunning(dev->ctx)) {
+      waitForEventThread(dev, USB_WAIT_FOREVER);
+    } else {
+      stream->anyCompleted = 0;
+      mutexUnlock(&dev->lock);
+      iStatus = libusb_handle_events_timeout_completed(
+        dev->ctx->libusb, &forever, &stream->anyCompleted);
+      mutexLock(&dev->lock);
+      if (iStatus < 0 && iStatus != LIBUSB_ERROR_INTERRUPTED) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Set up a read stream of either type, and get its transfers in flight.
+//
+static USBStatus startReadStream(
+  struct USBDevice *dev, uint8 endpoint, size_t depth, uint32 transferSize, uint32 numPackets,
+  uint32 timeout, struct USBReadStream **streamPtr, const char *func, const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  struct USBReadStream *stream;
+  struct LibraryBuffer *buffer;
+  size_t i;
+  *streamPtr = NULL;
+  CHECK_STATUS(
+    depth == 0 || transferSize == 0, USB_INVALID_OPTIONS, exit,
+    "%s(): Depth and transfer size must be nonzero", func);
+  stream = (struct USBReadStream *)calloc(1, sizeof(struct USBReadStream));
+  CHECK_STATUS(!stream, USB_ALLOC_ERR, exit, "%s(): Out of memory!", func);
+  stream->dev = dev;
+  stream->endpoint = LIBUSB_ENDPOINT_IN | endpoint;
+  stream->transferSize = transferSize;
+  stream->numPackets = numPackets;
+  stream->depth = depth;
+  stream->numBuffers = 2 * depth;
+  stream->transfers = (struct libusb_transfer **)calloc(depth, sizeof(struct libusb_transfer *));
+  stream->buffers = (struct LibraryBuffer *)calloc(stream->numBuffers, sizeof(struct LibraryBuffer));
+  stream->freeBuffers = (uint8 **)calloc(stream->numBuffers, sizeof(uint8 *));
+  stream->idle = (struct libusb_transfer **)calloc(depth, sizeof(struct libusb_transfer *));
+  stream->ring = (struct StreamEntry *)calloc(stream->numBuffers, sizeof(struct StreamEntry));
+  CHECK_STATUS(
+    !stream->transfers || !stream->buffers || !stream->freeBuffers || !stream->idle ||
+    !stream->ring, USB_ALLOC_ERR, cleanup, "%s(): Out of memory!", func);
+  if (numPackets) {
+    // The consumer's slot is never reused while it holds the buffer, so its results stay put
+    stream->packets = (struct IsoPacketReport *)calloc(
+      stream->numBuffers * numPackets, sizeof(struct IsoPacketReport));
+    CHECK_STATUS(!stream->packets, USB_ALLOC_ERR, cleanup, "%s(): Out of memory!", func);
+    for (i = 0; i < stream->numBuffers; i++) {
+      stream->ring[i].packets = stream->packets + i * numPackets;
+    }
+  }
+  for (i = 0; i < depth; i++) {
+    stream->transfers[i] = libusb_alloc_transfer((int)numPackets);
+    CHECK_STATUS(!stream->transfers[i], USB_ALLOC_ERR, cleanup, "%s(): Out of memory!", func);
+    if (numPackets) {
+      libusb_fill_iso_transfer(
+        stream->transfers[i], dev->handle, stream->endpoint, NULL, (int)transferSize,
+        (int)numPackets, stream_read_cb, stream, timeout
+      );
+      libusb_set_iso_packet_lengths(stream->transfers[i], transferSize / numPackets);
+    } else {
+      libusb_fill_bulk_transfer(
+        stream->transfers[i], dev->handle, stream->endpoint, NULL, (int)transferSize,
+        stream_read_cb, stream, timeout
+      );
+    }
+    stream->idle[stream->numIdle++] = stream->transfers[i];
+  }
+
+  mutexLock(&dev->lock);
+  for (i = 0; i < stream->numBuffers; i++) {
+    buffer = &stream->buffers[i];
+    buffer->data = allocLibraryBuffer(dev, transferSize, &buffer->isDevMem);
+    CHECK_STATUS(!buffer->data, USB_ALLOC_ERR, unlock, "%s(): Out of memory!", func);
+    stream->freeBuffers[stream->numFree++] = buffer->data;
+  }
+  while (stream->numIdle && !stream->failed) {
+    resubmitStreamTransfer(stream, stream->idle[--stream->numIdle]);
+  }
+  CHECK_STATUS(stream->failed, USB_ASYNC_SUBMIT, stop, "%s(): Submission error", func);
+  mutexUnlock(&dev->lock);
+  *streamPtr = stream;
+  return USB_SUCCESS;
+stop:
+  if (!stopReadStream(stream)) {
+    mutexUnlock(&dev->lock);
+    return retVal;  // leak the stream rather than free transfers LibUSB still owns
+  }
+unlock:
+  mutexUnlock(&dev->lock);
+cleanup:
+  destroyReadStream(stream);
+exit:
+  return retVal;
+}
+
+DLLEXPORT(USBStatus) usbStreamReadStart(
+  struct USBDevice *dev, uint8 endpoint, size_t depth, uint32 transferSize, uint32 timeout,
+  struct USBReadStream **streamPtr, const char **error)
+{
+  return startReadStream(
+    dev, endpoint, depth, transferSize, 0, timeout, streamPtr, "usbStreamReadStart", error);
+}
+
+DLLEXPORT(USBStatus) usbStreamIsoReadStart(
+  struct USBDevice *dev, uint8 endpoint, size_t depth, uint32 numPackets, uint32 timeout,
+  struct USBReadStream **streamPtr, const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  const int packetSize = libusb_get_max_iso_packet_size(
+    libusb_get_device(dev->handle), LIBUSB_ENDPOINT_IN | endpoint);
+  *streamPtr = NULL;
+  CHECK_STATUS(
+    packetSize <= 0, USB_CANNOT_GET_DESCRIPTOR, cleanup,
+    "usbStreamIsoReadStart(): Cannot get packet size of endpoint 0x%02X: %s",
+    LIBUSB_ENDPOINT_IN | endpoint, libusb_error_name(packetSize));
+  CHECK_STATUS(
+    (uint64)numPackets * (uint32)packetSize > INT_MAX, USB_ASYNC_SIZE, cleanup,
+    "usbStreamIsoReadStart(): Transfer length exceeds what LibUSB can submit");
+  retVal = startReadStream(
+    dev, endpoint, depth, numPackets * (uint32)packetSize, numPackets, timeout, streamPtr,
+    "usbStreamIsoReadStart", error);
+cleanup:
+  return retVal;
+}
+
+DLLEXPORT(USBStatus) usbStreamReadAwait(
+  struct USBReadStream *stream, struct CompletionReport *report, uint32 timeout,
+  const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  struct USBDevice *const dev = stream->dev;
+  const uint64 deadline = clockMillis() + timeout;
+  uint32 remaining = timeout;
+  struct timeval tv = NO_TIMEOUT;
+  const struct StreamEntry *entry;
+  int iStatus;
+  mutexLock(&dev->lock);
+  releaseStreamBuffer(stream);
+  while (stream->ringCount == 0) {
+    CHECK_STATUS(
+      stream->failed, USB_ASYNC_TRANSFER, cleanup,
+      "usbStreamReadAwait(): The stream has stopped after an error");
+    if (timeout != USB_WAIT_FOREVER) {
+      remaining = timeRemaining(deadline);
+      toTimeval(remaining, &tv);
+    }
+    if (isEventThreadRunning(dev->ctx)) {
+      CHECK_STATUS(remaining == 0, USB_PENDING, cleanup);
+      waitForEventThread(dev, remaining);
+    } else {
+      stream->anyCompleted = 0;
+      mutexUnlock(&dev->lock);
+      iStatus = libusb_handle_events_timeout_completed(
+        dev->ctx->libusb, &tv, &stream->anyCompleted);
+      mutexLock(&dev->lock);
+      CHECK_STATUS(
+        iStatus < 0 && iStatus != LIBUSB_ERROR_INTERRUPTED, USB_ASYNC_EVENT, cleanup,
+        "usbStreamReadAwait(): %s", libusb_error_name(iStatus));
+      CHECK_STATUS(stream->ringCount == 0 && remaining == 0, USB_PENDING, cleanup);
+    }
+  }
+  entry = &stream->ring[stream->ringHead];
+  stream->ringHead = (stream->ringHead + 1) % stream->numBuffers;
+  stream->ringCount--;
+  stream->held = entry->buffer;
+  report->buffer = entry->buffer;
+  report->requestLength = stream->transferSize;
+  report->actualLength = entry->actualLength;
+  report->flags.isRead = 1;
+  report->flags.isPoll = 0;
+  report->flags.pollStopped = 0;
+  report->id = stream->numDelivered++;
+  report->tag = 0;
+  report->transferStatus = (int)entry->status;
+  report->endpoint = stream->endpoint;
+  report->streamId = 0;
+  report->packets = entry->packets;
+  report->numPackets = stream->numPackets;
+  retVal = translateTransferStatus(entry->status, "usbStreamReadAwait", error);
+cleanup:
+  mutexUnlock(&dev->lock);
+  return retVal;
+}
+
+DLLEXPORT(void) usbStreamReadStop(struct USBReadStream *stream) {
+  if (stream) {
+    struct USBDevice *const dev = stream->dev;
+    bool stopped;
+    mutexLock(&dev->lock);
+    stopped = stopReadStream(stream);
+    mutexUnlock(&dev->lock);
+    if (stopped) {
+      destroyReadStream(stream);
+    }
+  }
+}
+
+// Producers' bytes are packed into the current buffer, which is submitted when it's full, when
+// the pipe would otherwise go idle, or (at the next append or completion) once its oldest byte
+// has waited longer than the latency allowed. There is one more buffer than transfers, so the
+// producer can keep packing while the pipe is full.
+//
+struct USBWriteStream {
+  struct USBDevice *dev;
+  uint8 endpoint;
+  uint32 transferSize;
+  uint32 latency;
+  size_t depth;                        // number of transfers
+  size_t numBuffers;
+  struct libusb_transfer **transfers;
+  struct libusb_transfer **idle;       // transfers not in flight
+  size_t numIdle;
+  struct LibraryBuffer *buffers;       // all of them, for freeing
+  uint8 **freeBuffers;                 // buffers neither in flight nor being packed
+  size_t numFree;
+  uint8 *current;                      // buffer being packed...
+  uint32 fill;                         // ...how much of it is used...
+  uint64 deadline;                     // ...and when it must be submitted
+  size_t numInFlight;
+  bool failed;                         // a transfer failed, so nothing more is submitted
+  enum libusb_transfer_status failure;
+  int anyCompleted;
+};
+
+static void destroyWriteStream(struct USBWriteStream *stream) {
+  size_t i;
+  if (stream->transfers) {
+    for (i = 0; i < stream->depth; i++) {
+      libusb_free_transfer(stream->transfers[i]);
+    }
+  }
+  if (stream->buffers) {
+    for (i = 0; i < stream->numBuffers; i++) {
+      if (stream->buffers[i].data) {
+        freeLibraryBuffer(
+          stream->dev, stream->buffers[i].data, stream->transferSize, stream->buffers[i].isDevMem);
+      }
+    }
+  }
+  free((void*)stream->transfers);
+  free((void*)stream->idle);
+  free((void*)stream->buffers);
+  free((void*)stream->freeBuffers);
+  free((void*)stream);
+}
+
+// Record a failure and cancel everything, so nothing more completes. Called with the device
+// lock held.
+//
+static void abortWriteStream(struct USBWriteStream *stream, enum libusb_transfer_status failure) {
+  size_t i;
+  if (!stream->failed) {
+    stream->failed = true;
+    stream->failure = failure;
+  }
+  for (i = 0; i < stream->depth; i++) {
+    libusb_cancel_transfer(stream->transfers[i]);
+  }
+}
+
+// Submit the buffer being packed on an idle transfer. Called with the device lock held.
+//
+static void submitWriteBuffer(struct USBWriteStream *stream) {
+  struct libusb_transfer *const transfer = stream->idle[--stream->numIdle];
+  transfer->buffer = stream->current;
+  transfer->length = (int)stream->fill;
+  stream->current = NULL;
+  if (libusb_submit_transfer(transfer) == LIBUSB_SUCCESS) {
+    stream->numInFlight++;
+  } else {
+    stream->freeBuffers[stream->numFree++] = transfer->buffer;
+    stream->idle[stream->numIdle++] = transfer;
+    abortWriteStream(stream, LIBUSB_TRANSFER_ERROR);
+  }
+}
+
+// Submit a partly-packed buffer if the pipe is idle or its deadline has passed. Called with the
+// device lock held.
+//
+static void flushWriteBufferIfDue(struct USBWriteStream *stream) {
+  if (
+    stream->current && stream->fill && stream->numIdle && !stream->failed &&
+    (stream->numInFlight == 0 || clockMillis() >= stream->deadline))
+  {
+    submitWriteBuffer(stream);
+  }
+}
+
+static void LIBUSB_CALL stream_write_cb(struct libusb_transfer *transfer) {
+  struct USBWriteStream *stream = transfer->user_data;
+  struct USBDevice *dev = stream->dev;
+  mutexLock(&dev->lock);
+  stream->numInFlight--;
+  stream->anyCompleted = 1;
+  stream->freeBuffers[stream->numFree++] = transfer->buffer;
+  stream->idle[stream->numIdle++] = transfer;
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+    abortWriteStream(stream, transfer->status);
+  } else {
+    flushWriteBufferIfDue(stream);
+  }
+  condBroadcast(&dev->completion);
+  mutexUnlock(&dev->lock);
+}
+
+// Wait for one of the stream's transfers to complete, or, with the event thread running, for a
+// while; callers loop until what they need has happened. Called with the device lock held.
+//
+static int awaitWriteStream(struct USBWriteStream *stream) {
+  struct USBDevice *const dev = stream->dev;
+  struct timeval forever = NO_TIMEOUT;
+  int iStatus = LIBUSB_SUCCESS;
+  if (isEventThreadRunning(dev->ctx)) {
+    waitForEventThread(dev, USB_WAIT_FOREVER);
+  } else {
+    stream->anyCompleted = 0;
+    mutexUnlock(&dev->lock);
+    iStatus = libusb_handle_events_timeout_completed(
+      dev->ctx->libusb, &forever, &stream->anyCompleted);
+    mutexLock(&dev->lock);
+    if (iStatus == LIBUSB_ERROR_INTERRUPTED) {
+      iStatus = LIBUSB_SUCCESS;
+    }
+  }
+  return iStatus;
+}
+
+DLLEXPORT(USBStatus) usbStreamWriteStart(
+  struct USBDevice *dev, uint8 endpoint, size_t depth, uint32 transferSize, uint32 latency,
+  uint32 timeout, struct USBWriteStream **streamPtr, const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  struct USBWriteStream *stream;
+  struct LibraryBuffer *buffer;
+  size_t i;
+  *streamPtr = NULL;
+  CHECK_STATUS(
+    depth == 0 || transferSize == 0, USB_INVALID_OPTIONS, exit,
+    "usbStreamWriteStart(): Depth and transfer size must be nonzero");
+  stream = (struct USBWriteStream *)calloc(1, sizeof(struct USBWriteStream));
+  CHECK_STATUS(!stream, USB_ALLOC_ERR, exit, "usbStreamWriteStart(): Out of memory!");
+  stream->dev = dev;
+  stream->endpoint = LIBUSB_ENDPOINT_OUT | endpoint;
+  stream->transferSize = transferSize;
+  stream->latency = latency;
+  stream->depth = depth;
+  stream->numBuffers = depth + 1;
+  stream->transfers = (struct libusb_transfer **)calloc(depth, sizeof(struct libusb_transfer *));
+  stream->idle = (struct libusb_transfer **)calloc(depth, sizeof(struct libusb_transfer *));
+  stream->buffers = (struct LibraryBuffer *)calloc(stream->numBuffers, sizeof(struct LibraryBuffer));
+  stream->freeBuffers = (uint8 **)calloc(stream->numBuffers, sizeof(uint8 *));
+  CHECK_STATUS(
+    !stream->transfers || !stream->idle || !stream->buffers || !stream->freeBuffers,
+    USB_ALLOC_ERR, cleanup, "usbStreamWriteStart(): Out of memory!");
+  for (i = 0; i < depth; i++) {
+    stream->transfers[i] = libusb_alloc_transfer(0);
+    CHECK_STATUS(
+      !stream->transfers[i], USB_ALLOC_ERR, cleanup, "usbStreamWriteStart(): Out of memory!");
+    libusb_fill_bulk_transfer(
+      stream->transfers[i], dev->handle, stream->endpoint, NULL, 0,
+      stream_write_cb, stream, timeout
+    );
+    stream->idle[stream->numIdle++] = stream->transfers[i];
+  }
+  mutexLock(&dev->lock);
+  for (i = 0; i < stream->numBuffers; i++) {
+    buffer = &stream->buffers[i];
+    buffer->data = allocLibraryBuffer(dev, transferSize, &buffer->isDevMem);
+    CHECK_STATUS(
+      !buffer->data, USB_ALLOC_ERR, unlock, "usbStreamWriteStart(): Out of memory!");
+    stream->freeBuffers[stream->numFree++] = buffer->data;
+  }
+  mutexUnlock(&dev->lock);
+  *streamPtr = stream;
+  return USB_SUCCESS;
+unlock:
+  mutexUnlock(&dev->lock);
+cleanup:
+  destroyWriteStream(stream);
+exit:
+  return retVal;
+}
+
+DLLEXPORT(USBStatus) usbStreamWrite(
+  struct USBWriteStream *stream, const uint8 *data, uint32 length, const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  struct USBDevice *const dev = stream->dev;
+  uint32 chunkLength;
+  int iStatus;
+  mutexLock(&dev->lock);
+  while (length) {
+    CHECK_STATUS(
+      stream->failed, translateTransferStatus(stream->failure, "usbStreamWrite", NULL), cleanup,
+      "usbStreamWrite(): The stream has stopped after an error");
+    if (!stream->current) {
+      if (stream->numFree == 0) {
+        iStatus = awaitWriteStream(stream);
+        CHECK_STATUS(
+          iStatus < 0, USB_ASYNC_EVENT, cleanup,
+          "usbStreamWrite(): %s", libusb_error_name(iStatus));
+        continue;
+      }
+      stream->current = stream->freeBuffers[--stream->numFree];
+      stream->fill = 0;
+      stream->deadline = clockMillis() + stream->latency;
+    }
+    chunkLength = stream->transferSize - stream->fill;
+    if (chunkLength > length) {
+      chunkLength = length;
+    }
+    memcpy(stream->current + stream->fill, data, chunkLength);
+    stream->fill += chunkLength;
+    data += chunkLength;
+    length -= chunkLength;
+    while (stream->fill == stream->transferSize && stream->current) {
+      CHECK_STATUS(
+        stream->failed, translateTransferStatus(stream->failure, "usbStreamWrite", NULL), cleanup,
+        "usbStreamWrite(): The stream has stopped after an error");
+      if (stream->numIdle) {
+        submitWriteBuffer(stream);
+      } else {
+        iStatus = awaitWriteStream(stream);
+        CHECK_STATUS(
+          iStatus < 0, USB_ASYNC_EVENT, cleanup,
+          "usbStreamWrite(): %s", libusb_error_name(iStatus));
+      }
+    }
+  }
+  flushWriteBufferIfDue(stream);
+  CHECK_STATUS(
+    stream->failed, translateTransferStatus(stream->failure, "usbStreamWrite", NULL), cleanup,
+    "usbStreamWrite(): The stream has stopped after an error");
+cleanup:
+  mutexUnlock(&dev->lock);
+  return retVal;
+}
+
+DLLEXPORT(USBStatus) usbStreamWriteFlush(struct USBWriteStream *stream, const char **error) {
+  USBStatus retVal = USB_SUCCESS;
+  struct USBDevice *const dev = stream->dev;
+  int iStatus;
+  mutexLock(&dev->lock);
+  while (!stream->failed && (stream->numInFlight || (stream->current && stream->fill))) {
+    if (stream->current && stream->fill && stream->numIdle) {
+      submitWriteBuffer(stream);
+    } else {
+      iStatus = awaitWriteStream(stream);
+      CHECK_STATUS(
+        iStatus < 0, USB_ASYNC_EVENT, cleanup,
+        "usbStreamWriteFlush(): %s", libusb_error_name(iStatus));
+    }
+  }
+  CHECK_STATUS(
+    stream->failed, translateTransferStatus(stream->failure, "usbStreamWriteFlush", NULL), cleanup,
+    "usbStreamWriteFlush(): The stream has stopped after an error");
+cleanup:
+  mutexUnlock(&dev->lock);
+  return retVal;
+}
+
+DLLEXPORT(void) usbStreamWriteStop(struct USBWriteStream *stream) {
+  if (stream) {
+    struct USBDevice *const dev = stream->dev;
+    bool stopped;
+    mutexLock(&dev->lock);
+    abortWriteStream(stream, LIBUSB_TRANSFER_CANCELLED);
+    while (stream->numInFlight) {
+      if (awaitWriteStream(stream) < 0) {
+        break;
+      }
+    }
+    stopped = (stream->numInFlight == 0);
+    mutexUnlock(&dev->lock);
+    if (stopped) {
+      destroyWriteStream(stream);  // otherwise leak it: LibUSB still owns some of its transfers
+    }
+  }
+}
+
+// Whether a context's event thread has been asked to stop.
+//
+static bool isEventThreadStopping(struct USBContext *ctx) {
+  bool stopping;
+  mutexLock(&ctx->lock);
+  stopping = ctx->eventThreadStop;
+  mutexUnlock(&ctx->lock);
+  return stopping;
+}
+
+// Body of an event-handling thread: service its context until asked to stop. If LibUSB fails
+// (e.g. with LIBUSB_ERROR_NO_MEM), retrying would just spin, so record the error and give up;
+// threads waiting for completions then see it isn't running, and handle events themselves.
+//
+static THREAD_FUNC(eventThreadFunc) {
+  struct USBContext *const ctx = (struct USBContext *)arg;
+  struct timeval timeout = {0, 100000};  // wake periodically to check for shutdown
+  int iStatus;
+  while (!isEventThreadStopping(ctx)) {
+    iStatus = libusb_handle_events_timeout_completed(ctx->libusb, &timeout, NULL);
+    if (iStatus < 0 && iStatus != LIBUSB_ERROR_INTERRUPTED) {
+      mutexLock(&ctx->lock);
+      ctx->eventThreadError = iStatus;
+      ctx->eventThreadStop = true;
+      mutexUnlock(&ctx->lock);
+    }
+  }
+  THREAD_RETURN;
+}
+
+// Wait for a context's event thread to exit, once it has been told to stop or has given up. The
+// lock is dropped across the join, because the thread takes it to check for a stop, and its
+// callbacks take device locks which waiters hold while taking it. Called with the context lock
+// held.
+//
+static void joinEventThread(struct USBContext *ctx) {
+  const Thread thread = ctx->eventThread;
+  ctx->eventThreadJoining = true;
+  mutexUnlock(&ctx->lock);
+  #if LIBUSB_API_VERSION >= 0x01000105
+    libusb_interrupt_event_handler(ctx->libusb);
+  #endif
+  threadJoin(thread);
+  mutexLock(&ctx->lock);
+  ctx->eventThreadRunning = false;
+  ctx->eventThreadJoining = false;
+}
+
+// Start a context's event thread, unless it's already running.
+//
+static USBStatus startEventThread(struct USBContext *ctx, const char *func, const char **error) {
+  USBStatus retVal = USB_SUCCESS;
+  CHECK_STATUS(
+    !ctx->libusb, USB_INIT, cleanup,
+    "%s(): you forgot to call usbInitialise()!", func);
+  mutexLock(&ctx->lock);
+  CHECK_STATUS(
+    ctx->eventThreadJoining, USB_THREAD, unlock,
+    "%s(): The event thread is still stopping", func);
+  if (ctx->eventThreadRunning && ctx->eventThreadStop) {
+    // It gave up, or was stopped from its own callback, so it has exited or soon will
+    CHECK_STATUS(
+      threadIsCurrent(ctx->eventThread), USB_THREAD, unlock,
+      "%s(): The event thread cannot restart itself", func);
+    joinEventThread(ctx);
+  }
+  if (!ctx->eventThreadRunning) {
+    ctx->eventThreadStop = false;
+    ctx->eventThreadError = LIBUSB_SUCCESS;
+    CHECK_STATUS(
+      !threadCreate(&ctx->eventThread, eventThreadFunc, ctx), USB_THREAD, unlock,
+      "%s(): Cannot create event thread", func);
+    ctx->eventThreadRunning = true;
+  }
+unlock:
+  mutexUnlock(&ctx->lock);
+cleanup:
+  return retVal;
+}
+
+DLLEXPORT(USBStatus) usbEventThreadStart(const char **error) {
+  return startEventThread(&m_defaultContext, "usbEventThreadStart", error);
+}
+
+DLLEXPORT(void) usbEventThreadStop(void) {
+  usbContextEventThreadStop(NULL);
+}
+
+DLLEXPORT(USBStatus) usbContextEventThreadStart(struct USBContext *ctx, const char **error) {
+  return startEventThread(
+    ctx ? ctx : &m_defaultContext, "usbContextEventThreadStart", error);
+}
+
+DLLEXPORT(void) usbContextEventThreadStop(struct USBContext *ctx) {
+  if (!ctx) {
+    ctx = &m_defaultContext;
+  }
+
+  // Waiters notice the flag within EVENT_THREAD_POLL_MS, and take over handling events. Called
+  // from one of its own callbacks, the thread can't be joined; it just exits when the callback
+  // returns, and is reaped by the next start or stop.
+  mutexLock(&ctx->lock);
+  ctx->eventThreadStop = true;
+  if (
+    ctx->eventThreadRunning && !ctx->eventThreadJoining && !threadIsCurrent(ctx->eventThread))
+  {
+    joinEventThread(ctx);
+  }
+  mutexUnlock(&ctx->lock);
+}
+
+static USBStatus getPollFds(
+  struct USBContext *ctx, struct USBPollFd *fds, size_t maxFds, size_t *numFds,
+  const char *func, const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  const struct libusb_pollfd **pollFds = NULL;
+  size_t i;
+  *numFds = 0;
+  CHECK_STATUS(
+    !ctx->libusb, USB_INIT, cleanup,
+    "%s(): you forgot to call usbInitialise()!", func);
+  pollFds = libusb_get_pollfds(ctx->libusb);
+  CHECK_STATUS(
+    !pollFds, USB_ASYNC_EVENT, cleanup,
+    "%s(): LibUSB cannot supply its file descriptors on this platform", func);
+  for (i = 0; pollFds[i]; i++) {
+    if (i < maxFds) {
+      fds[i].fd = pollFds[i]->fd;
+      fds[i].events = pollFds[i]->events;
+    }
+  }
+  *numFds = i;
+cleanup:
+  if (pollFds) {
+    #if LIBUSB_API_VERSION >= 0x01000104
+      libusb_free_pollfds(pollFds);
+    #else
+      free((void *)pollFds);
+    #endif
+  }
+  return retVal;
+}
+
+DLLEXPORT(USBStatus) usbGetPollFds(
+  struct USBPollFd *fds, size_t maxFds, size_t *numFds, const char **error)
+{
+  return getPollFds(&m_defaultContext, fds, maxFds, numFds, "usbGetPollFds", error);
+}
+
+DLLEXPORT(USBStatus) usbContextGetPollFds(
+  struct USBContext *ctx, struct USBPollFd *fds, size_t maxFds, size_t *numFds,
+  const char **error)
+{
+  return getPollFds(
+    ctx ? ctx : &m_defaultContext, fds, maxFds, numFds, "usbContextGetPollFds", error);
+}
+
+// LibUSB's notifiers may use a different calling convention, so forward them to the caller's.
+//
+static void LIBUSB_CALL pollFdAdded(int fd, short events, void *userData) {
+  const struct USBContext *const ctx = (const struct USBContext *)userData;
+  if (ctx->pollFdAdded) {
+    ctx->pollFdAdded(fd, events, ctx->pollFdData);
+  }
+}
+static void LIBUSB_CALL pollFdRemoved(int fd, void *userData) {
+  const struct USBContext *const ctx = (const struct USBContext *)userData;
+  if (ctx->pollFdRemoved) {
+    ctx->pollFdRemoved(fd, ctx->pollFdData);
+  }
+}
+
+// Register the notifiers, or remember them until the context is initialised.
+//
+static void setPollFdNotifiers(
+  struct USBContext *ctx, USBPollFdAddedCallback added, USBPollFdRemovedCallback removed,
+  void *userData)
+{
+  ctx->pollFdAdded = added;
+  ctx->pollFdRemoved = removed;
+  ctx->pollFdData = userData;
+  if (ctx->libusb) {
+    libusb_set_pollfd_notifiers(
+      ctx->libusb, added ? pollFdAdded : NULL, removed ? pollFdRemoved : NULL, ctx);
+  }
+}
+
+DLLEXPORT(void) usbSetPollFdNotifiers(
+  USBPollFdAddedCallback added, USBPollFdRemovedCallback removed, void *userData)
+{
+  setPollFdNotifiers(&m_defaultContext, added, removed, userData);
+}
+
+DLLEXPORT(void) usbContextSetPollFdNotifiers(
+  struct USBContext *ctx, USBPollFdAddedCallback added, USBPollFdRemovedCallback removed,
+  void *userData)
+{
+  setPollFdNotifiers(ctx ? ctx : &m_defaultContext, added, removed, userData);
+}
+
+static USBStatus getNextTimeout(
+  struct USBContext *ctx, uint32 *timeout, const char *func, const char **error)
+{
+  USBStatus retVal = USB_SUCCESS;
+  struct timeval tv;
+  int iStatus;
+  uint64 ms;
+  *timeout = USB_WAIT_FOREVER;
+  CHECK_STATUS(
+    !ctx->libusb, USB_INIT, cleanup,
+    "%s(): you forgot to call usbInitialise()!", func);
+  if (libusb_pollfds_handle_timeouts(ctx->libusb)) {
+    goto cleanup;  // a timerfd among the descriptors fires when one is due
+  }
+  iStatus = libusb_get_next_timeout(ctx->libusb, &tv);
+  CHECK_STATUS(
+    iStatus < 0, USB_ASYNC_EVENT, cleanup,
+    "%s(): %s", func, libusb_error_name(iStatus));
+  if (iStatus == 1) {
+    ms = (uint64)tv.tv_sec * 1000 + ((uint64)tv.tv_usec + 999) / 1000;
+    *timeout = (ms < USB_WAIT_FOREVER) ? (uint32)ms : USB_WAIT_FOREVER - 1;
+  }
+cleanup:
+  return retVal;
+}
+
+DLLEXPORT(USBStatus) usbGetNextTimeout(uint32 *timeout, const char **error) {
+  return getNextTimeout(&m_defaultContext, timeout, "usbGetNextTimeout", error);
+}
+
+DLLEXPORT(USBStatus) usbContextGetNextTimeout(
+  struct USBContext *ctx, uint32 *timeout, const char **error)
+{
+  return getNextTimeout(
+    ctx ? ctx : &m_defaultContext, timeout, "usbContextGetNextTimeout", error);
+}
+
+static USBStatus handleEventsNow(struct USBContext *ctx, const char *func, const char **error) {
+  USBStatus retVal = USB_SUCCESS;
+  struct timeval zero = {0, 0};
+  int iStatus;
+  CHECK_STATUS(
+    !ctx->libusb, USB_INIT, cleanup,
+    "%s(): you forgot to call usbInitialise()!", func);
+  iStatus = libusb_handle_events_timeout_completed(ctx->libusb, &zero, NULL);
+  CHECK_STATUS(
+    iStatus < 0 && iStatus != LIBUSB_ERROR_INTERRUPTED, USB_ASYNC_EVENT, cleanup,
+    "%s(): %s", func, libusb_error_name(iStatus));
+cleanup:
+  return retVal;
+}
+
+DLLEXPORT(USBStatus) usbHandleEventsNow(const char **error) {
+  return handleEventsNow(&m_defaultContext, "usbHandleEventsNow", error);
+}
+
+DLLEXPORT(USBStatus) usbContextHandleEventsNow(struct USBContext *ctx, const char **error) {
+  return handleEventsNow(ctx ? ctx : &m_defaultContext, "usbContextHandleEventsNow", error);
 }
@@ -28,14 +28,83 @@
 #endif
 #include <makestuff/libusbwrap.h>
 #include "unbounded_queue.h"
+#include "threads.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+  // One in-flight queue for each endpoint number in each direction
+  #define NUM_QUEUES 32
+  #define QUEUE_INDEX(endpoint) (((endpoint) & 0x0F) | (((endpoint) & LIBUSB_ENDPOINT_IN) >> 3))
+
+  struct TransferWrapper;
+
+  // A continuously-polled interrupt IN endpoint
+  struct InterruptPoll {
+    uint32 length;
+    uint32 timeout;
+    uint64 tag;     // given to every read
+    bool active;
+  };
+
+  // An endpoint's stall recovery policy, and the state of any recovery in progress
+  struct StallRecovery {
+    uint32 maxRetries;    // per transfer; zero disables recovery
+    uint32 numStalls;
+    uint32 numRecoveries;
+    size_t numAwaiting;   // transfers cancelled behind the stalled one, not yet back
+    bool recovering;
+  };
+
+  // A library buffer waiting in a device's pool
+  struct LibraryBuffer {
+    uint8 *data;
+    bool isDevMem;  // from libusb_dev_mem_alloc(), rather than the heap
+  };
+
+  // A LibUSB context, and the thread handling its events, if there is one
+  struct USBContext {
+    struct libusb_context *libusb;
+    USBPollFdAddedCallback pollFdAdded;  // the application's event loop's notifiers, if any
+    USBPollFdRemovedCallback pollFdRemoved;
+    void *pollFdData;
+    Thread eventThread;
+    Mutex lock;                // guards the fields below
+    bool eventThreadRunning;   // started, and not yet joined
+    bool eventThreadStop;      // asked to stop, or gave up; no longer servicing events
+    bool eventThreadJoining;   // usbContextEventThreadStop() is waiting for it to exit
+    int eventThreadError;      // the LibUSB error it gave up on, if it did
+  };
+
   struct USBDevice {
     struct libusb_device_handle *handle;
-    struct UnboundedQueue queue;
+    struct USBContext *ctx;           // whose events drive this device's transfers
+    struct UnboundedQueue queues[NUM_QUEUES];  // created on first use of each endpoint
+    struct USBOpenOptions options;    // queue depths & library buffer size
+    size_t numOutstanding;            // total number of transfers in all the queues
+    size_t numReady;                  // how many of those have completed
+    size_t numDelivering;             // how many of those are with the completion callback
+    size_t numArmed;                  // how many are poll reads not yet completed
+    struct TransferWrapper *spare;    // buffer handed out by usbBulkWriteAsyncPrepare()
+    struct LibraryBuffer *freeBuffers;  // library buffers not lent to any transfer
+    size_t numFreeBuffers;
+    size_t freeBuffersCapacity;
+    struct LibraryBuffer *leased;     // library buffers lent out by usbBufferLease()
+    size_t numLeased;
+    size_t leasedCapacity;
+    bool noDevMem;                    // libusb_dev_mem_alloc() failed, so just use the heap
+    uint16 maxPacketSize[NUM_QUEUES]; // each endpoint's, looked up on first use
+    struct InterruptPoll polls[16];   // indexed by IN endpoint number
+    struct StallRecovery stalls[NUM_QUEUES];
+    Mutex lock;                       // guards the queues & the completion flags of their transfers
+    CondVar completion;               // broadcast whenever one of this device's transfers completes
+    USBCompletionCallback callback;   // if non-NULL, completions are delivered here
+    void *callbackData;
+    bool draining;                    // usbCancelAll() is reaping, so hold back completions
+    uint32 numSubmitted;              // used to assign transfer ids
+    uint32 numCompleted;              // used to record the order in which transfers complete
+    int anyCompleted;                 // set whenever one of this device's transfers completes
   };
 
 #ifdef __cplusplus
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2009-2012 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef THREADS_H
+#define THREADS_H
+
+// Minimal portable threading primitives: just enough to run an event-handling thread and to
+// let other threads sleep until it reports a completion.
+//
+#ifdef WIN32
+  #include <Windows.h>
+#else
+  #include <pthread.h>
+  #include <time.h>
+#endif
+#include <makestuff/common.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef WIN32
+  typedef SRWLOCK Mutex;
+  typedef CONDITION_VARIABLE CondVar;
+  typedef HANDLE Thread;
+  #define MUTEX_INITIALIZER SRWLOCK_INIT
+  #define THREAD_FUNC(name) DWORD WINAPI name(LPVOID arg)
+  #define THREAD_RETURN return 0
+
+  static inline void mutexInit(Mutex *m) { InitializeSRWLock(m); }
+  static inline void mutexDestroy(Mutex *m) { (void)m; }
+  static inline void mutexLock(Mutex *m) { AcquireSRWLockExclusive(m); }
+  static inline void mutexUnlock(Mutex *m) { ReleaseSRWLockExclusive(m); }
+
+  static inline void condInit(CondVar *c) { InitializeConditionVariable(c); }
+  static inline void condDestroy(CondVar *c) { (void)c; }
+  static inline void condWait(CondVar *c, Mutex *m) {
+    SleepConditionVariableSRW(c, m, INFINITE, 0);
+  }
+  static inline void condWaitTimeout(CondVar *c, Mutex *m, uint32 ms) {
+    SleepConditionVariableSRW(c, m, ms, 0);
+  }
+  static inline void condBroadcast(CondVar *c) { WakeAllConditionVariable(c); }
+
+  static inline bool threadCreate(Thread *t, LPTHREAD_START_ROUTINE func, void *arg) {
+    *t = CreateThread(NULL, 0, func, arg, 0, NULL);
+    return *t != NULL;
+  }
+  static inline void threadJoin(Thread t) {
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+  }
+  static inline bool threadIsCurrent(Thread t) {
+    return GetThreadId(t) == GetCurrentThreadId();
+  }
+
+  static inline uint64 clockMillis(void) {
+    return (uint64)GetTickCount64();
+  }
+#else
+  typedef pthread_mutex_t Mutex;
+  typedef pthread_cond_t CondVar;
+  typedef pthread_t Thread;
+  #define MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+  #define THREAD_FUNC(name) void *name(void *arg)
+  #define THREAD_RETURN return NULL
+
+  static inline void mutexInit(Mutex *m) { pthread_mutex_init(m, NULL); }
+  static inline void mutexDestroy(Mutex *m) { pthread_mutex_destroy(m); }
+  static inline void mutexLock(Mutex *m) { pthread_mutex_lock(m); }
+  static inline void mutexUnlock(Mutex *m) { pthread_mutex_unlock(m); }
+
+  // Timed waits are relative, so use the monotonic clock where the platform lets us.
+  //
+  static inline void condInit(CondVar *c) {
+    #ifdef __APPLE__
+      pthread_cond_init(c, NULL);
+    #else
+      pthread_condattr_t attr;
+      pthread_condattr_init(&attr);
+      pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+      pthread_cond_init(c, &attr);
+      pthread_condattr_destroy(&attr);
+    #endif
+  }
+  static inline void condDestroy(CondVar *c) { pthread_cond_destroy(c); }
+  static inline void condWait(CondVar *c, Mutex *m) { pthread_cond_wait(c, m); }
+  static inline void condWaitTimeout(CondVar *c, Mutex *m, uint32 ms) {
+    struct timespec ts;
+    #ifdef __APPLE__
+      ts.tv_sec = ms / 1000;
+      ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+      pthread_cond_timedwait_relative_np(c, m, &ts);
+    #else
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      ts.tv_sec += ms / 1000;
+      ts.tv_nsec += (long)(ms % 1000) * 1000000L;
+      if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(c, m, &ts);
+    #endif
+  }
+  static inline void condBroadcast(CondVar *c) { pthread_cond_broadcast(c); }
+
+  static inline bool threadCreate(Thread *t, void *(*func)(void *), void *arg) {
+    return pthread_create(t, NULL, func, arg) == 0;
+  }
+  static inline void threadJoin(Thread t) {
+    pthread_join(t, NULL);
+  }
+  static inline bool threadIsCurrent(Thread t) {
+    return pthread_equal(t, pthread_self()) != 0;
+  }
+
+  static inline uint64 clockMillis(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64)ts.tv_sec * 1000 + (uint64)ts.tv_nsec / 1000000;
+  }
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
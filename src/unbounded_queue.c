@@ -44,40 +44,37 @@ void queueDestroy(struct UnboundedQueue *self) {
   }
 }
 
-// Everything is preserved if a reallocation fails
+// Reallocate the item array, preserving the order of the items starting from the take index,
+// and create new items to fill the extra space. Everything is preserved if a reallocation fails.
 //
-USBStatus queuePut(struct UnboundedQueue *self, Item *item) {
+static USBStatus queueGrow(struct UnboundedQueue *self, size_t newCapacity) {
   USBStatus retVal = USB_SUCCESS;
+  Item *const ptr = self->itemArray + self->takeIndex;
+  const size_t firstHalfLength = self->capacity - self->takeIndex;
+  const size_t secondHalfLength = self->takeIndex;
   Item *newArray = NULL;
   size_t index = 0;
-  if (self->numItems == self->capacity) {
-    Item *const ptr = self->itemArray + self->takeIndex;
-    const size_t firstHalfLength = self->capacity - self->takeIndex;
-    const size_t secondHalfLength = self->takeIndex;
-    const size_t newCapacity = 2 * self->capacity;
-    Item newItem;
-    newArray = (Item *)calloc(newCapacity, sizeof(Item));
-    CHECK_STATUS(newArray == NULL, USB_ALLOC_ERR, cleanup);
-    memcpy((void*)newArray, ptr, firstHalfLength * sizeof(Item));
-    if (secondHalfLength) {
-      memcpy(
-        (void*)(newArray + firstHalfLength),
-        self->itemArray,
-        secondHalfLength * sizeof(Item)
-      );
-    }
-    for (index = self->capacity; index < newCapacity; index++) {
-      newItem = (*self->createFunc)();
-      CHECK_STATUS(newItem == NULL, USB_ALLOC_ERR, cleanup);
-      newArray[index] = newItem;
-    }
-    free((void*)self->itemArray);
-    self->itemArray = newArray;
-    self->takeIndex = 0;
-    self->putIndex = self->capacity;
-    self->capacity = newCapacity;
+  Item newItem;
+  newArray = (Item *)calloc(newCapacity, sizeof(Item));
+  CHECK_STATUS(newArray == NULL, USB_ALLOC_ERR, cleanup);
+  memcpy((void*)newArray, ptr, firstHalfLength * sizeof(Item));
+  if (secondHalfLength) {
+    memcpy(
+      (void*)(newArray + firstHalfLength),
+      self->itemArray,
+      secondHalfLength * sizeof(Item)
+    );
   }
-  *item = self->itemArray[self->putIndex];
+  for (index = self->capacity; index < newCapacity; index++) {
+    newItem = (*self->createFunc)();
+    CHECK_STATUS(newItem == NULL, USB_ALLOC_ERR, cleanup);
+    newArray[index] = newItem;
+  }
+  free((void*)self->itemArray);
+  self->itemArray = newArray;
+  self->takeIndex = 0;
+  self->putIndex = self->numItems;
+  self->capacity = newCapacity;
   return USB_SUCCESS;
 cleanup:
   if (newArray) {
@@ -89,6 +86,31 @@ cleanup:
   return retVal;
 }
 
+USBStatus queuePut(struct UnboundedQueue *self, Item *item) {
+  USBStatus retVal = USB_SUCCESS;
+  if (self->numItems == self->capacity) {
+    retVal = queueGrow(self, 2 * self->capacity);
+    CHECK_STATUS(retVal, retVal, cleanup);
+  }
+  *item = self->itemArray[self->putIndex];
+cleanup:
+  return retVal;
+}
+
+// Ensure the next count puts will succeed without reallocating.
+//
+USBStatus queueReserve(struct UnboundedQueue *self, size_t count) {
+  USBStatus retVal = USB_SUCCESS;
+  size_t newCapacity = self->capacity;
+  while (newCapacity - self->numItems < count) {
+    newCapacity *= 2;
+  }
+  if (newCapacity != self->capacity) {
+    retVal = queueGrow(self, newCapacity);
+  }
+  return retVal;
+}
+
 void queueCommitPut(struct UnboundedQueue *self) {
   self->numItems++;
   self->putIndex++;
@@ -97,6 +119,15 @@ void queueCommitPut(struct UnboundedQueue *self) {
   }
 }
 
+// Replace the item reserved by queuePut() with one supplied by the caller, who takes ownership
+// of the item it displaces.
+//
+Item queueExchangePut(struct UnboundedQueue *self, Item item) {
+  const Item displaced = self->itemArray[self->putIndex];
+  self->itemArray[self->putIndex] = item;
+  return displaced;
+}
+
 USBStatus queueTake(struct UnboundedQueue *self, Item *item) {
   USBStatus retVal = 0;
   CHECK_STATUS(self->numItems == 0, USB_EMPTY_QUEUE, cleanup);
@@ -112,3 +143,36 @@ void queueCommitTake(struct UnboundedQueue *self) {
     self->takeIndex = 0;
   }
 }
+
+USBStatus queuePeek(const struct UnboundedQueue *self, size_t offset, Item *item) {
+  USBStatus retVal = 0;
+  size_t index;
+  CHECK_STATUS(offset >= self->numItems, USB_EMPTY_QUEUE, cleanup);
+  index = self->takeIndex + offset;
+  if (index >= self->capacity) {
+    index -= self->capacity;
+  }
+  *item = self->itemArray[index];
+cleanup:
+  return retVal;
+}
+
+// Shuffle the items ahead of the one at the given offset back by one slot, so it ends up at the
+// head, then take it as usual. This preserves the order of the remaining items.
+//
+void queueCommitTakeAt(struct UnboundedQueue *self, size_t offset) {
+  size_t index = self->takeIndex + offset;
+  size_t prev;
+  Item item;
+  if (index >= self->capacity) {
+    index -= self->capacity;
+  }
+  item = self->itemArray[index];
+  while (index != self->takeIndex) {
+    prev = index ? index - 1 : self->capacity - 1;
+    self->itemArray[index] = self->itemArray[prev];
+    index = prev;
+  }
+  self->itemArray[index] = item;
+  queueCommitTake(self);
+}
@@ -27,15 +27,27 @@ extern "C" {
   USBStatus queuePut(
     struct UnboundedQueue *self, Item *item  // never blocks, can ENOMEM
   );
+  USBStatus queueReserve(
+    struct UnboundedQueue *self, size_t count  // make room for count puts in one allocation
+  );
   void queueCommitPut(
     struct UnboundedQueue *self
   );
+  Item queueExchangePut(
+    struct UnboundedQueue *self, Item item  // after queuePut(), returns the displaced item
+  );
   USBStatus queueTake(
     struct UnboundedQueue *self, Item *item  // returns NULL on empty
   );
   void queueCommitTake(
     struct UnboundedQueue *self
   );
+  USBStatus queuePeek(
+    const struct UnboundedQueue *self, size_t offset, Item *item  // offset from the head
+  );
+  void queueCommitTakeAt(
+    struct UnboundedQueue *self, size_t offset  // remove an item from the middle of the queue
+  );
   void queueDestroy(
     struct UnboundedQueue *self
   );
@@ -381,6 +381,211 @@ TEST(Queue, testReallocOOM) {
   queueDestroy(&queue);
 }
 
+TEST(Queue, testPeek) {
+  struct UnboundedQueue queue;
+  uint32 *item;
+  m_count = 1;
+
+  // Create queue
+  USBStatus status = queueInit(&queue, 4, (CreateFunc)createInt, (DestroyFunc)destroyInt);
+  ASSERT_EQ(USB_SUCCESS, status);
+
+  // Shift indices so the peeks have to wrap
+  queue.putIndex = 3;
+  queue.takeIndex = 3;
+
+  // Put three items into the queue
+  status = queuePut(&queue, (Item*)&item);
+  ASSERT_EQ(USB_SUCCESS, status);
+  *item = 5;
+  queueCommitPut(&queue);
+  status = queuePut(&queue, (Item*)&item);
+  ASSERT_EQ(USB_SUCCESS, status);
+  *item = 6;
+  queueCommitPut(&queue);
+  status = queuePut(&queue, (Item*)&item);
+  ASSERT_EQ(USB_SUCCESS, status);
+  *item = 7;
+  queueCommitPut(&queue);
+
+  // Peek at each of them
+  status = queuePeek(&queue, 0, (Item*)&item);
+  ASSERT_EQ(USB_SUCCESS, status);
+  ASSERT_EQ(5UL, *item);
+  status = queuePeek(&queue, 1, (Item*)&item);
+  ASSERT_EQ(USB_SUCCESS, status);
+  ASSERT_EQ(6UL, *item);
+  status = queuePeek(&queue, 2, (Item*)&item);
+  ASSERT_EQ(USB_SUCCESS, status);
+  ASSERT_EQ(7UL, *item);
+
+  // Try to peek beyond the end
+  status = queuePeek(&queue, 3, (Item*)&item);
+  ASSERT_EQ(USB_EMPTY_QUEUE, status);
+
+  // Peeking does not remove anything
+  ASSERT_EQ(3UL, queue.numItems);
+
+  // Clean up
+  queueDestroy(&queue);
+}
+
+TEST(Queue, testTakeAt) {
+  struct UnboundedQueue queue;
+  uint32 *item;
+  uint32 *third;
+  m_count = 1;
+
+  // Create queue
+  USBStatus status = queueInit(&queue, 4, (CreateFunc)createInt, (DestroyFunc)destroyInt);
+  ASSERT_EQ(USB_SUCCESS, status);
+
+  // Shift indices so the shuffle has to wrap
+  queue.putIndex = 2;
+  queue.takeIndex = 2;
+
+  // Put four items into the queue
+  status = queuePut(&queue, (Item*)&item);
+  ASSERT_EQ(USB_SUCCESS, status);
+  *item = 5;
+  queueCommitPut(&queue);
+  status = queuePut(&queue, (Item*)&item);
+  ASSERT_EQ(USB_SUCCESS, status);
+  *item = 6;
+  queueCommitPut(&queue);
+  status = queuePut(&queue, (Item*)&item);
+  ASSERT_EQ(USB_SUCCESS, status);
+  *item = 7;
+  queueCommitPut(&queue);
+  status = queuePut(&queue, (Item*)&item);
+  ASSERT_EQ(USB_SUCCESS, status);
+  *item = 8;
+  queueCommitPut(&queue);
+
+  // Take the third one out of the middle
+  status = queuePeek(&queue, 2, (Item*)&third);
+  ASSERT_EQ(USB_SUCCESS, status);
+  ASSERT_EQ(7UL, *third);
+  queueCommitTakeAt(&queue, 2);
+
+  // Verify
+  ASSERT_EQ(4UL, queue.capacity);
+  ASSERT_EQ(2UL, queue.putIndex);
+  ASSERT_EQ(3UL, queue.takeIndex);
+  ASSERT_EQ(3UL, queue.numItems);
+
+  // The others are still in order
+  status = queueTake(&queue, (Item*)&item);
+  ASSERT_EQ(USB_SUCCESS, status);
+  ASSERT_EQ(5UL, *item);
+  queueCommitTake(&queue);
+  status = queueTake(&queue, (Item*)&item);
+  ASSERT_EQ(USB_SUCCESS, status);
+  ASSERT_EQ(6UL, *item);
+  queueCommitTake(&queue);
+  status = queueTake(&queue, (Item*)&item);
+  ASSERT_EQ(USB_SUCCESS, status);
+  ASSERT_EQ(8UL, *item);
+  queueCommitTake(&queue);
+
+  // ...and the removed item is recycled rather than lost
+  status = queuePut(&queue, (Item*)&item);
+  ASSERT_EQ(USB_SUCCESS, status);
+  ASSERT_EQ(third, item);
+
+  // Clean up
+  queueDestroy(&queue);
+}
+
+TEST(Queue, testExchangePut) {
+  struct UnboundedQueue queue;
+  uint32 *item;
+  uint32 *displaced;
+  uint32 replacement = 9;
+  m_count = 1;
+
+  // Create queue
+  USBStatus status = queueInit(&queue, 4, (CreateFunc)createInt, (DestroyFunc)destroyInt);
+  ASSERT_EQ(USB_SUCCESS, status);
+
+  // Reserve a slot, then swap in our own item
+  status = queuePut(&queue, (Item*)&item);
+  ASSERT_EQ(USB_SUCCESS, status);
+  ASSERT_EQ(1UL, *item);
+  displaced = (uint32 *)queueExchangePut(&queue, &replacement);
+  ASSERT_EQ(item, displaced);
+  queueCommitPut(&queue);
+
+  // Verify
+  status = queueTake(&queue, (Item*)&item);
+  ASSERT_EQ(USB_SUCCESS, status);
+  ASSERT_EQ(&replacement, item);
+  queueCommitTake(&queue);
+
+  // Swap the original back in before the queue frees it
+  status = queuePut(&queue, (Item*)&item);
+  ASSERT_EQ(USB_SUCCESS, status);
+  queueCommitPut(&queue);
+  status = queuePut(&queue, (Item*)&item);
+  ASSERT_EQ(USB_SUCCESS, status);
+  queueCommitPut(&queue);
+  status = queuePut(&queue, (Item*)&item);
+  ASSERT_EQ(USB_SUCCESS, status);
+  queueCommitPut(&queue);
+  status = queuePut(&queue, (Item*)&item);
+  ASSERT_EQ(USB_SUCCESS, status);
+  ASSERT_EQ(&replacement, item);
+  queueExchangePut(&queue, displaced);
+
+  // Clean up
+  queueDestroy(&queue);
+}
+
+TEST(Queue, testReserve) {
+  struct UnboundedQueue queue;
+  uint32 *item;
+  m_count = 1;
+
+  // Create queue
+  USBStatus status = queueInit(&queue, 2, (CreateFunc)createInt, (DestroyFunc)destroyInt);
+  ASSERT_EQ(USB_SUCCESS, status);
+
+  // Shift indices so the reallocation has to unwrap the array
+  queue.putIndex = 1;
+  queue.takeIndex = 1;
+
+  // Put one item into the queue
+  status = queuePut(&queue, (Item*)&item);
+  ASSERT_EQ(USB_SUCCESS, status);
+  ASSERT_EQ(2UL, *item);
+  *item = 100;
+  queueCommitPut(&queue);
+
+  // Reserving what's already free does nothing
+  status = queueReserve(&queue, 1);
+  ASSERT_EQ(USB_SUCCESS, status);
+  ASSERT_EQ(2UL, queue.capacity);
+
+  // Make room for five more in one go
+  status = queueReserve(&queue, 5);
+  ASSERT_EQ(USB_SUCCESS, status);
+
+  // Verify
+  ASSERT_EQ(8UL, queue.capacity);
+  ASSERT_EQ(1UL, queue.putIndex);
+  ASSERT_EQ(0UL, queue.takeIndex);
+  ASSERT_EQ(1UL, queue.numItems);
+
+  // Verify array
+  ASSERT_EQ(100UL, deref(queue.itemArray[0]));
+  ASSERT_EQ(1UL, deref(queue.itemArray[1]));
+  ASSERT_EQ(3UL, deref(queue.itemArray[2]));
+  ASSERT_EQ(8UL, deref(queue.itemArray[7]));
+
+  // Clean up
+  queueDestroy(&queue);
+}
+
 TEST(Queue, testAllocFreeMatching) {
   ASSERT_EQ(0, m_allocFree);
 }